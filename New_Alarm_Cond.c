@@ -10,451 +10,2284 @@
  * so that the alarm thread will wake up and process the earlier
  * timeout first, requeueing the later request.
  */
+#define _GNU_SOURCE
 #include <pthread.h>
 #include <time.h>
 #include "errors.h"
-#include <semaphore.h>
+#include "alarm_sched.h"
+#include "alarm_ring.h"
+#include "alarm_scan.h"
+#include <getopt.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/un.h>
 
+/*
+ * The scheduler itself lives in alarm_sched.c (libalarm); this
+ * file is its front end: the console, the socket server and the
+ * submission ring all turn their input into library calls, and
+ * fired alarms come back through display_print, to each group's
+ * display thread, or alarm_print on a virtual clock.
+ */
+alarm_sched_t *scheduler;
+
+/*
+ * Fired alarms are written to standard output a batch at a time
+ * with writev, by the display threads or, on a virtual clock, by
+ * alarm_print. Messages of DELIVERY_COPY_MAX bytes or more are not
+ * copied: their iovecs point straight at the text in the
+ * scheduler's arena, so such a message is copied once on its way
+ * from the input to the output, when the scheduler stores it.
+ * Shorter ones, and the "(seconds) " prefixes and newlines, are
+ * gathered into one staging buffer, since the kernel's cost per
+ * iovec outweighs copying a few dozen bytes.
+ */
+#ifndef IOV_MAX
+#define IOV_MAX 1024    /* POSIX minimum is 16; Linux takes 1024 */
+#endif
+#define DELIVERY_COPY_MAX 256
+
+typedef struct segment_tag
+{
+    const char *base;       /* arena text, or NULL for the staging buffer */
+    size_t offset, len;     /* offset is into the staging buffer */
+} segment_t;
+
+typedef struct delivery_tag
+{
+    char *stage;
+    size_t stage_len, stage_size;
+    segment_t *seg;
+    struct iovec *iov;
+    int count, size;        /* segments */
+} delivery_t;
+
+delivery_t delivery;
+
+/*
+ * Write every byte described by "iov", however many entries there
+ * are and however little each writev call takes.
+ */
+void writev_all(int fd, struct iovec *iov, int count)
+{
+    ssize_t done;
+
+    while (count > 0)
+    {
+        done = writev(fd, iov, count > IOV_MAX ? IOV_MAX : count);
+        if (done < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            errno_abort("Write alarms");
+        }
+        while (count > 0 && (size_t)done >= iov->iov_len)
+        {
+            done -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0)
+        {
+            iov->iov_base = (char *)iov->iov_base + done;
+            iov->iov_len -= done;
+        }
+    }
+}
+
+/*
+ * Add a segment to the batch.
+ */
+segment_t *delivery_segment(delivery_t *batch)
+{
+    if (batch->count == batch->size)
+    {
+        batch->size = batch->size ? batch->size * 2 : 64;
+        batch->seg = (segment_t *)realloc(batch->seg,
+            batch->size * sizeof(segment_t));
+        batch->iov = (struct iovec *)realloc(batch->iov,
+            batch->size * sizeof(struct iovec));
+        if (batch->seg == NULL || batch->iov == NULL)
+            errno_abort("Allocate delivery batch");
+    }
+    return &batch->seg[batch->count++];
+}
+
+/*
+ * Reserve "len" more bytes at the end of the staging buffer,
+ * extending the last segment if it is a staging one.
+ */
+char *delivery_stage(delivery_t *batch, size_t len)
+{
+    segment_t *seg;
+    char *at;
+
+    if (batch->stage_len + len > batch->stage_size)
+    {
+        batch->stage_size = (batch->stage_len + len) * 2;
+        batch->stage = (char *)realloc(batch->stage, batch->stage_size);
+        if (batch->stage == NULL)
+            errno_abort("Allocate delivery batch");
+    }
+    at = batch->stage + batch->stage_len;
+    batch->stage_len += len;
+    seg = batch->count > 0 ? &batch->seg[batch->count - 1] : NULL;
+    if (seg != NULL && seg->base == NULL)
+    {
+        seg->len += len;
+        return at;
+    }
+    seg = delivery_segment(batch);
+    seg->base = NULL;
+    seg->offset = at - batch->stage;
+    seg->len = len;
+    return at;
+}
+
+/*
+ * Add a fired alarm's line, "(seconds) message", to the batch. The
+ * message must stay valid until the batch is written.
+ */
+void delivery_add(delivery_t *batch, int seconds, const char *message,
+                  size_t length)
+{
+    segment_t *seg;
+    char head[16], *at;
+    int len;
+
+    len = snprintf(head, sizeof(head), "(%d) ", seconds);
+    if (length < DELIVERY_COPY_MAX)
+    {
+        at = delivery_stage(batch, len + length + 1);
+        memcpy(at, head, len);
+        memcpy(at + len, message, length);
+        at[len + length] = '\n';
+        return;
+    }
+    memcpy(delivery_stage(batch, len), head, len);
+    seg = delivery_segment(batch);
+    seg->base = message;
+    seg->len = length;
+    *delivery_stage(batch, 1) = '\n';
+}
+
+/*
+ * Write the batch to standard output and empty it. Command replies
+ * go through stdio; let any already made go first, so that the
+ * output reads in the order it happened and no line lands inside
+ * a reply.
+ */
+void delivery_write(delivery_t *batch)
+{
+    segment_t *seg;
+    int i, chunk;
+
+    fflush(stdout);
+    for (i = 0; i < batch->count; i++)
+    {
+        seg = &batch->seg[i];
+        batch->iov[i].iov_base = seg->base != NULL
+            ? (void *)seg->base : batch->stage + seg->offset;
+        batch->iov[i].iov_len = seg->len;
+    }
+    for (i = 0; i < batch->count; i += chunk)
+    {
+        chunk = batch->count - i < IOV_MAX ? batch->count - i : IOV_MAX;
+        writev_all(STDOUT_FILENO, batch->iov + i, chunk);
+    }
+    batch->count = 0;
+    batch->stage_len = 0;
+}
+
+/*
+ * Free the batch's buffers.
+ */
+void delivery_free(delivery_t *batch)
+{
+    free(batch->stage);
+    free(batch->seg);
+    free(batch->iov);
+    memset(batch, 0, sizeof(*batch));
+}
+
+/*
+ * Delivery callback on a virtual clock: runs on the thread that
+ * advanced the clock, with no lock held. Firings are queued until
+ * the batch's flush event, which the scheduler sends while the
+ * messages are still valid.
+ */
+void alarm_print(const alarm_event_t *event, void *arg)
+{
+    delivery_t *batch = (delivery_t *)arg;
+
+    if (event->type == ALARM_EVENT_FIRED)
+        delivery_add(batch, event->seconds, event->message, event->length);
+    else if (event->type == ALARM_EVENT_FLUSH && batch->count > 0)
+        delivery_write(batch);
+}
+
+/*
+ * Display threads. On the real clock each group that is firing
+ * alarms has a display thread, which prints the group's firings.
+ * The timer thread's callback, display_print, appends a batch's
+ * firings to per-group queues, then signals the display thread of
+ * each group that had an alarm in it -- once per batch, on that
+ * thread's own condition variable. Otherwise a display thread
+ * sleeps, so quiet groups cost nothing, and nothing polls the
+ * alarms.
+ *
+ * Threads come and go with the load. A group with no display
+ * thread gets one when an alarm in it fires: one parked in the
+ * cache if there is one, a new one otherwise. A display thread
+ * that has had nothing to print for DISPLAY_PARK msec leaves its
+ * group, whose entry is freed, and parks in the cache; one that
+ * has been parked for DISPLAY_REAP msec, or finds the cache full,
+ * exits. Threads alive stay at about the number of groups active
+ * at once, and a group that fires now and then reuses a parked
+ * thread rather than creating one each time. A parked thread keeps
+ * its write buffers for the next group, unless its last group left
+ * it with room for more than DISPLAY_KEEP lines.
+ *
+ * The queues hold references, not copies: display_print keeps
+ * each message with alarm_sched_message_keep, and the display
+ * thread writes it with delivery_write, straight from the
+ * scheduler's arena, and then drops it.
+ *
+ * Output keeps the order the scheduler delivered in. Each group
+ * with alarms in a batch takes a turn, in the order the batch
+ * reached it, which is highest priority first; a display thread
+ * writes its lines of a batch only when its turn comes. The groups
+ * of a batch are therefore printed one after another, led by the
+ * one with its most urgent alarm, and one batch's lines never
+ * follow the next's. A virtual-clock replay prints inline through
+ * alarm_print instead.
+ */
+#define DISPLAY_PARK     2000   /* msec idle before leaving a group */
+#define DISPLAY_REAP     30000  /* msec parked before exiting */
+#define DISPLAY_CACHE    16     /* parked threads kept */
+#define DISPLAY_KEEP     4096   /* lines' buffers a parked thread keeps */
+#define DISPLAY_HASH_MIN 64
+
+typedef struct worker_tag
+{
+    struct worker_tag *link;        /* next in the cache */
+    struct display_tag *display;    /* group served; NULL while parked */
+    pthread_cond_t cond;
+    delivery_t batch;               /* the lines being written */
+    struct line_tag *lines;         /* the queue taken, or a spare */
+    int line_size;
+    const char **written;           /* their messages, to drop */
+    int written_size;
+} worker_t;
+
+typedef struct line_tag
+{
+    unsigned long turn;             /* the batch's turn for the group */
+    int seconds;
+    const char *message;            /* kept; see alarm_sched_message_keep */
+    size_t length;
+} line_t;
+
+typedef struct display_tag
+{
+    struct display_tag *link;       /* next in the same display_table bucket */
+    struct display_tag *touched;    /* next with lines in this batch */
+    int group_id;
+    worker_t *worker;               /* NULL if none is serving the group */
+    unsigned long turn;             /* in this batch, if touched */
+    line_t *lines;                  /* lines waiting to be printed */
+    int line_count, line_size;
+} display_t;
+
+/*
+ * All display state is under display_mutex. The thread delivering
+ * a batch takes it at the first firing and keeps it until the
+ * batch's flush, so a batch costs one lock however many alarms
+ * are in it; display threads take it only between writes.
+ */
+pthread_mutex_t display_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t display_idle = PTHREAD_COND_INITIALIZER;  /* a write finished */
+int display_locked;                 /* delivering thread: holds display_mutex */
+unsigned long display_turns;        /* turns handed out */
+unsigned long display_turn;         /* the turn being written */
+display_t **display_table;
+unsigned display_size, display_count;
+display_t *display_touched, *display_touched_last;  /* in first-fired order */
+worker_t *display_cache;
+int display_cached;
+int display_writing;                /* threads printing right now */
+cpu_set_t display_cpus;             /* -a display=: where they run */
+int display_pinned;
+
+unsigned display_index(int group_id, unsigned size)
+{
+    return ((unsigned)group_id * 2654435761u) & (size - 1);
+}
+
+/*
+ * Remove a display from the table and free it.
+ *
+ * LOCKING PROTOCOL: caller must hold display_mutex.
+ */
+void display_free(display_t *display)
+{
+    display_t **last;
+
+    last = &display_table[display_index(display->group_id, display_size)];
+    while (*last != display)
+        last = &(*last)->link;
+    *last = display->link;
+    display_count--;
+    free(display->lines);
+    free(display);
+}
+
+/*
+ * Wait on a worker's condition variable for at most "msec".
+ *
+ * LOCKING PROTOCOL: caller must hold display_mutex.
+ */
+void display_wait(worker_t *worker, long msec)
+{
+    struct timespec until;
+    int status;
+
+    clock_gettime(CLOCK_REALTIME, &until);
+    until.tv_sec += msec / 1000;
+    until.tv_nsec += (msec % 1000) * 1000000;
+    if (until.tv_nsec >= 1000000000)
+    {
+        until.tv_sec++;
+        until.tv_nsec -= 1000000000;
+    }
+    status = pthread_cond_timedwait(&worker->cond, &display_mutex, &until);
+    if (status != 0 && status != ETIMEDOUT)
+        err_abort(status, "Wait on display");
+}
+
+/*
+ * Free a display thread's write buffers.
+ */
+void worker_trim(worker_t *worker)
+{
+    delivery_free(&worker->batch);
+    free(worker->lines);
+    free(worker->written);
+    worker->lines = NULL;
+    worker->written = NULL;
+    worker->line_size = worker->written_size = 0;
+}
+
+/*
+ * A display thread: print its group's queue whenever there is
+ * anything in it, taking the whole queue in exchange for an empty
+ * one and writing outside the lock, each batch's lines in their
+ * turn. Its state is re-read after every wait rather than inferred
+ * from how the wait ended, since a timeout and a new group or new
+ * lines can race.
+ */
+void *display_thread(void *arg)
+{
+    worker_t *worker = (worker_t *)arg;
+    display_t *display;
+    worker_t **last;
+    line_t *lines, *swap;
+    int count, swap_size, i, run, status;
+
+    status = pthread_mutex_lock(&display_mutex);
+    if (status != 0)
+        err_abort(status, "Lock display");
+    while (1)
+    {
+        display = worker->display;
+        if (display != NULL && display->line_count > 0)
+        {
+            swap = display->lines;
+            swap_size = display->line_size;
+            count = display->line_count;
+            display->lines = worker->lines;
+            display->line_size = worker->line_size;
+            display->line_count = 0;
+            if (count > worker->written_size)
+            {
+                worker->written_size = swap_size;
+                worker->written = (const char **)realloc(worker->written,
+                    worker->written_size * sizeof(const char *));
+                if (worker->written == NULL)
+                    errno_abort("Allocate display queue");
+            }
+            worker->lines = lines = swap;
+            worker->line_size = swap_size;
+            display_writing++;
+
+            for (i = 0; i < count; i = run)
+            {
+                while (display_turn != lines[i].turn)
+                {
+                    status = pthread_cond_wait(&display_idle, &display_mutex);
+                    if (status != 0)
+                        err_abort(status, "Wait on display");
+                }
+                status = pthread_mutex_unlock(&display_mutex);
+                if (status != 0)
+                    err_abort(status, "Unlock display");
+
+                for (run = i; run < count && lines[run].turn == lines[i].turn; run++)
+                {
+                    delivery_add(&worker->batch, lines[run].seconds,
+                                 lines[run].message, lines[run].length);
+                    worker->written[run - i] = lines[run].message;
+                }
+                flockfile(stdout);
+                delivery_write(&worker->batch);
+                funlockfile(stdout);
+                alarm_sched_message_release(scheduler, worker->written, run - i);
+
+                status = pthread_mutex_lock(&display_mutex);
+                if (status != 0)
+                    err_abort(status, "Lock display");
+                display_turn++;
+                status = pthread_cond_broadcast(&display_idle);
+                if (status != 0)
+                    err_abort(status, "Broadcast display");
+            }
+            display_writing--;
+            status = pthread_cond_broadcast(&display_idle);
+            if (status != 0)
+                err_abort(status, "Broadcast display");
+            continue;
+        }
+
+        if (display != NULL)
+        {
+            /*
+             * Nothing to print: wait for more, and leave the group
+             * if none comes.
+             */
+            display_wait(worker, DISPLAY_PARK);
+            if (worker->display->line_count > 0)
+                continue;
+            display_free(worker->display);
+            worker->display = NULL;
+            if (worker->line_size > DISPLAY_KEEP)
+                worker_trim(worker);
+            if (display_cached >= DISPLAY_CACHE)
+                break;
+            worker->link = display_cache;
+            display_cache = worker;
+            display_cached++;
+            continue;
+        }
+
+        /*
+         * Parked: wait for a group, and exit if none comes.
+         */
+        display_wait(worker, DISPLAY_REAP);
+        if (worker->display != NULL)
+            continue;
+        for (last = &display_cache; *last != worker; last = &(*last)->link)
+            ;
+        *last = worker->link;
+        display_cached--;
+        break;
+    }
+    status = pthread_mutex_unlock(&display_mutex);
+    if (status != 0)
+        err_abort(status, "Unlock display");
+    worker_trim(worker);
+    pthread_cond_destroy(&worker->cond);
+    free(worker);
+    return NULL;
+}
+
+/*
+ * Give a display a thread: a parked one if the cache has one, a
+ * new one otherwise.
+ *
+ * LOCKING PROTOCOL: caller must hold display_mutex.
+ */
+void display_start(display_t *display)
+{
+    worker_t *worker;
+    pthread_t thread;
+    pthread_attr_t attr;
+    int status;
+
+    worker = display_cache;
+    if (worker != NULL)
+    {
+        display_cache = worker->link;
+        display_cached--;
+        worker->display = display;
+        display->worker = worker;
+
+        /*
+         * It is asleep in display_wait until the reap timeout;
+         * wake it for its new group.
+         */
+        status = pthread_cond_signal(&worker->cond);
+        if (status != 0)
+            err_abort(status, "Signal display");
+        return;
+    }
+    worker = (worker_t *)calloc(1, sizeof(worker_t));
+    if (worker == NULL)
+        errno_abort("Allocate display thread");
+    status = pthread_cond_init(&worker->cond, NULL);
+    if (status != 0)
+        err_abort(status, "Init display cond");
+    worker->display = display;
+    display->worker = worker;
+
+    /*
+     * Created by the timer thread, a display thread would run
+     * where it runs unless told otherwise.
+     */
+    status = pthread_attr_init(&attr);
+    if (status != 0)
+        err_abort(status, "Init display attr");
+    status = pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (status != 0)
+        err_abort(status, "Detach display thread");
+    if (display_pinned)
+    {
+        status = pthread_attr_setaffinity_np(
+            &attr, sizeof(display_cpus), &display_cpus);
+        if (status != 0)
+            err_abort(status, "Pin display thread");
+    }
+    status = pthread_create(&thread, &attr, display_thread, worker);
+    if (status != 0)
+        err_abort(status, "Create display thread");
+    pthread_attr_destroy(&attr);
+}
+
+/*
+ * The display for a group, adding one if it has none.
+ *
+ * LOCKING PROTOCOL: caller must hold display_mutex.
+ */
+display_t *display_find(int group_id)
+{
+    display_t *display, **table, *move;
+    unsigned size, i, index;
+
+    if (display_table != NULL)
+    {
+        display = display_table[display_index(group_id, display_size)];
+        for (; display != NULL; display = display->link)
+            if (display->group_id == group_id)
+                return display;
+    }
+
+    if (display_count >= display_size)
+    {
+        size = display_size ? display_size * 2 : DISPLAY_HASH_MIN;
+        table = (display_t **)calloc(size, sizeof(display_t *));
+        if (table == NULL)
+            errno_abort("Allocate display table");
+        for (i = 0; i < display_size; i++)
+        {
+            for (display = display_table[i]; display != NULL; display = move)
+            {
+                move = display->link;
+                index = display_index(display->group_id, size);
+                display->link = table[index];
+                table[index] = display;
+            }
+        }
+        free(display_table);
+        display_table = table;
+        display_size = size;
+    }
+
+    display = (display_t *)calloc(1, sizeof(display_t));
+    if (display == NULL)
+        errno_abort("Allocate display");
+    display->group_id = group_id;
+    index = display_index(group_id, display_size);
+    display->link = display_table[index];
+    display_table[index] = display;
+    display_count++;
+    return display;
+}
+
+/*
+ * Queue a fired alarm for its group's display thread. The message
+ * must have been kept with alarm_sched_message_keep; the display
+ * thread drops it once written. The first call of a batch takes
+ * display_mutex, which display_wake lets go.
+ */
+void display_queue(const alarm_event_t *event)
+{
+    display_t *display;
+    line_t *line;
+    int status;
+
+    if (!display_locked)
+    {
+        status = pthread_mutex_lock(&display_mutex);
+        if (status != 0)
+            err_abort(status, "Lock display");
+        display_locked = 1;
+    }
+    display = display_find(event->group_id);
+    if (display->touched == NULL && display != display_touched_last)
+    {
+        if (display_touched_last == NULL)
+            display_touched = display;
+        else
+            display_touched_last->touched = display;
+        display_touched_last = display;
+        display->turn = display_turns++;
+    }
+    if (display->line_count == display->line_size)
+    {
+        display->line_size = display->line_size ? display->line_size * 2 : 64;
+        display->lines = (line_t *)realloc(display->lines,
+            display->line_size * sizeof(line_t));
+        if (display->lines == NULL)
+            errno_abort("Allocate display queue");
+    }
+    line = &display->lines[display->line_count++];
+    line->turn = display->turn;
+    line->seconds = event->seconds;
+    line->message = event->message;
+    line->length = event->length;
+}
+
+/*
+ * At the end of a batch, wake the display thread of every group
+ * with lines in it, starting one where there is none.
+ */
+void display_wake(void)
+{
+    display_t *display;
+    int status;
+
+    if (!display_locked)
+        return;
+
+    /*
+     * A batch comes highest priority first, so the groups with the
+     * most urgent alarms in it are woken first.
+     */
+    display_touched_last = NULL;
+    while ((display = display_touched) != NULL)
+    {
+        display_touched = display->touched;
+        display->touched = NULL;
+        if (display->worker == NULL)
+            display_start(display);
+        else
+        {
+            status = pthread_cond_signal(&display->worker->cond);
+            if (status != 0)
+                err_abort(status, "Signal display");
+        }
+    }
+    display_locked = 0;
+    status = pthread_mutex_unlock(&display_mutex);
+    if (status != 0)
+        err_abort(status, "Unlock display");
+}
+
+/*
+ * Delivery callback on the real clock; see display_t.
+ */
+void display_print(const alarm_event_t *event, void *arg)
+{
+    (void)arg;
+    if (event->type == ALARM_EVENT_FIRED)
+    {
+        alarm_sched_message_keep(scheduler, event);
+        display_queue(event);
+    }
+    else if (event->type == ALARM_EVENT_FLUSH)
+        display_wake();
+}
+
+/*
+ * Wait until the display threads have printed everything they
+ * were given, before the program exits.
+ */
+void display_flush(void)
+{
+    display_t *display;
+    unsigned i;
+    int status, pending;
+
+    status = pthread_mutex_lock(&display_mutex);
+    if (status != 0)
+        err_abort(status, "Lock display");
+    do
+    {
+        pending = display_writing;
+        for (i = 0; i < display_size && !pending; i++)
+            for (display = display_table[i]; display != NULL; display = display->link)
+                pending |= display->line_count > 0;
+        if (pending)
+        {
+            status = pthread_cond_wait(&display_idle, &display_mutex);
+            if (status != 0)
+                err_abort(status, "Wait on display");
+        }
+    } while (pending);
+    status = pthread_mutex_unlock(&display_mutex);
+    if (status != 0)
+        err_abort(status, "Unlock display");
+}
+
+/*
+ * Real-time mode (-R). The timer thread runs under SCHED_FIFO and
+ * must not allocate, block on I/O or wait for a display lock held
+ * by an ordinary thread, which display_print does: it grows queues
+ * and starts display threads. So in real-time mode the callback
+ * is handoff_print instead, which copies each batch's events into
+ * a buffer allocated at startup, keeping their messages rather
+ * than copying them, and a dispatch thread feeds the batches to
+ * the display queues. The buffer is double: the dispatch
+ * thread takes the full one and leaves an empty one in its place.
+ * If the timer thread fills its half before the dispatcher has
+ * taken the other, it waits; "waits" counts the times, which
+ * should be none.
+ */
+#define HANDOFF_SIZE    (1024 * 1024)
+#define HANDOFF_RESERVE 4096    /* firings the scheduler allocates ahead */
+
+typedef struct handoff_tag
+{
+    pthread_mutex_t mutex;      /* priority-inheriting */
+    pthread_cond_t ready;       /* a batch is in "fill" */
+    pthread_cond_t room;        /* "fill" was taken */
+    int locked;                 /* timer thread: holds mutex */
+    char *fill, *drain;
+    size_t fill_len;
+    int draining;               /* dispatcher: delivering "drain" */
+    unsigned long waits;
+} handoff_t;
+
+handoff_t *handoff;
+
+/*
+ * Callback on the real clock in real-time mode.
+ */
+void handoff_print(const alarm_event_t *event, void *arg)
+{
+    int status;
+
+    (void)arg;
+    if (!handoff->locked)
+    {
+        status = pthread_mutex_lock(&handoff->mutex);
+        if (status != 0)
+            err_abort(status, "Lock handoff");
+        handoff->locked = 1;
+    }
+    if (event->type == ALARM_EVENT_FLUSH)
+    {
+        status = pthread_cond_signal(&handoff->ready);
+        if (status != 0)
+            err_abort(status, "Signal handoff");
+        handoff->locked = 0;
+        status = pthread_mutex_unlock(&handoff->mutex);
+        if (status != 0)
+            err_abort(status, "Unlock handoff");
+        return;
+    }
+
+    alarm_sched_message_keep(scheduler, event);
+    while (handoff->fill_len + sizeof(alarm_event_t) > HANDOFF_SIZE)
+    {
+        handoff->waits++;
+        status = pthread_cond_signal(&handoff->ready);
+        if (status != 0)
+            err_abort(status, "Signal handoff");
+        status = pthread_cond_wait(&handoff->room, &handoff->mutex);
+        if (status != 0)
+            err_abort(status, "Wait for handoff");
+    }
+    memcpy(handoff->fill + handoff->fill_len, event, sizeof(alarm_event_t));
+    handoff->fill_len += sizeof(alarm_event_t);
+}
+
+/*
+ * The dispatch thread: take each full buffer and queue what is in
+ * it for the display threads, as one batch.
+ */
+void *handoff_thread(void *arg)
+{
+    char *swap;
+    size_t len, at;
+    int status;
+
+    (void)arg;
+    status = pthread_mutex_lock(&handoff->mutex);
+    if (status != 0)
+        err_abort(status, "Lock handoff");
+    while (1)
+    {
+        while (handoff->fill_len == 0)
+        {
+            status = pthread_cond_wait(&handoff->ready, &handoff->mutex);
+            if (status != 0)
+                err_abort(status, "Wait for handoff");
+        }
+        swap = handoff->drain;
+        handoff->drain = handoff->fill;
+        handoff->fill = swap;
+        len = handoff->fill_len;
+        handoff->fill_len = 0;
+        handoff->draining = 1;
+        status = pthread_cond_broadcast(&handoff->room);
+        if (status != 0)
+            err_abort(status, "Broadcast handoff");
+        status = pthread_mutex_unlock(&handoff->mutex);
+        if (status != 0)
+            err_abort(status, "Unlock handoff");
+
+        for (at = 0; at < len; at += sizeof(alarm_event_t))
+            display_queue((alarm_event_t *)(handoff->drain + at));
+        display_wake();
+
+        status = pthread_mutex_lock(&handoff->mutex);
+        if (status != 0)
+            err_abort(status, "Lock handoff");
+        handoff->draining = 0;
+        status = pthread_cond_broadcast(&handoff->room);
+        if (status != 0)
+            err_abort(status, "Broadcast handoff");
+    }
+    return NULL;
+}
+
+/*
+ * Enter real-time mode: lock the process's memory, allocate the
+ * handoff and start the dispatch thread, then the scheduler. The
+ * timer thread's priority is "priority".
+ */
+alarm_sched_t *handoff_start(long slack, int priority)
+{
+    pthread_mutexattr_t attr;
+    alarm_realtime_t realtime;
+    alarm_sched_t *sched;
+    pthread_t thread;
+    int status;
+
+    if (mlockall(MCL_CURRENT | MCL_FUTURE) == -1)
+        errno_abort("Lock memory");
+    handoff = (handoff_t *)calloc(1, sizeof(handoff_t));
+    if (handoff == NULL)
+        errno_abort("Allocate handoff");
+    handoff->fill = (char *)malloc(HANDOFF_SIZE);
+    handoff->drain = (char *)malloc(HANDOFF_SIZE);
+    if (handoff->fill == NULL || handoff->drain == NULL)
+        errno_abort("Allocate handoff");
+
+    /*
+     * Touch every page now, so that the timer thread never takes
+     * the fault for one.
+     */
+    memset(handoff->fill, 0, HANDOFF_SIZE);
+    memset(handoff->drain, 0, HANDOFF_SIZE);
+
+    status = pthread_mutexattr_init(&attr);
+    if (status != 0)
+        err_abort(status, "Init handoff attr");
+    status = pthread_mutexattr_setprotocol(&attr, PTHREAD_PRIO_INHERIT);
+    if (status != 0)
+        err_abort(status, "Set handoff protocol");
+    status = pthread_mutex_init(&handoff->mutex, &attr);
+    if (status != 0)
+        err_abort(status, "Init handoff");
+    pthread_mutexattr_destroy(&attr);
+    status = pthread_cond_init(&handoff->ready, NULL);
+    if (status != 0)
+        err_abort(status, "Init handoff");
+    status = pthread_cond_init(&handoff->room, NULL);
+    if (status != 0)
+        err_abort(status, "Init handoff");
+    status = pthread_create(&thread, NULL, handoff_thread, NULL);
+    if (status != 0)
+        err_abort(status, "Create dispatch thread");
+
+    realtime.priority = priority;
+    realtime.reserve = HANDOFF_RESERVE;
+    sched = alarm_sched_create_realtime(handoff_print, NULL, slack, &realtime);
+    return sched;
+}
+
+/*
+ * Wait until the dispatch thread has passed on everything handed
+ * to it; nothing to do outside real-time mode.
+ */
+void handoff_flush(void)
+{
+    int status;
+
+    if (handoff == NULL)
+        return;
+    status = pthread_mutex_lock(&handoff->mutex);
+    if (status != 0)
+        err_abort(status, "Lock handoff");
+    while (handoff->fill_len > 0 || handoff->draining)
+    {
+        status = pthread_cond_wait(&handoff->room, &handoff->mutex);
+        if (status != 0)
+            err_abort(status, "Wait for handoff");
+    }
+    status = pthread_mutex_unlock(&handoff->mutex);
+    if (status != 0)
+        err_abort(status, "Unlock handoff");
+}
+
+/*
+ * Print one alarm of a list() or query() command to "arg", the
+ * reply stream.
+ */
+void list_alarm(const alarm_info_t *info, void *arg)
+{
+    if (info->priority > 0)
+        fprintf((FILE *)arg, "Alarm(%d): Group(%d) Priority(%d) %ld %s\n",
+                info->alarm_id, info->group_id, info->priority,
+                (long)info->time, info->message);
+    else
+        fprintf((FILE *)arg, "Alarm(%d): Group(%d) %ld %s\n",
+                info->alarm_id, info->group_id, (long)info->time, info->message);
+}
+
+/*
+ * Parse and carry out one command line, "len" bytes long (see
+ * command_parse in alarm_scan.h). The line is only read, so it
+ * may lie in a read-only mapping; the message is passed on and
+ * printed by its length. Replies go to "out" and
+ * errors to "err": stdout and stderr for the console, or a buffer
+ * that is sent back to a socket client.
+ */
+void alarm_command(char *line, size_t len, FILE *out, FILE *err)
+{
+    int status, interval, count;
+    long slack;
+    long long from, to;
+    command_t command;
+    alarm_bulk_t bulk;
+    alarm_info_t info;
+    alarm_stats_t stats;
+
+    command_parse(line, len, &command);
+    switch (command.op)
+    {
+    case COMMAND_SLACK:
+        /*
+         * Set the slack for a group. Lax groups get wide
+         * windows so their alarms share wakeups; groups that
+         * need tight timing keep 0.
+         */
+        slack = command.slack;
+        if (slack < 0)
+            slack = 0;
+        status = alarm_sched_group_slack(scheduler, command.group_id, slack);
+        if (status != 0)
+            err_abort(status, "Set group slack");
+        fprintf(out, "Group(%d) Slack Set to %ld msec\n", command.group_id, slack);
+        break;
+    case COMMAND_CANCEL:
+        status = alarm_sched_cancel(scheduler, command.alarm_id, &info);
+        if (status == ENOENT)
+            fprintf(err, "Alarm(%d) Not Found\n", command.alarm_id);
+        else
+            fprintf(out, "Alarm(%d) Canceled at %ld: Group(%d) %s\n",
+                command.alarm_id, (long)(alarm_sched_now(scheduler) / 1000),
+                info.group_id, info.message);
+        alarm_sched_info_release(scheduler, &info);
+        break;
+    case COMMAND_LIST:
+        /*
+         * The scan runs alongside inserts and cancels from the
+         * other threads rather than holding them up.
+         */
+        count = alarm_sched_range(scheduler, command.alarm_id, command.last,
+                                  list_alarm, out);
+        fprintf(out, "Listed %d Alarms from %d to %d\n",
+                count, command.alarm_id, command.last);
+        break;
+    case COMMAND_QUERY:
+        /*
+         * A window of whole seconds, walked in firing order down
+         * the deadline queue, again without holding anything up.
+         */
+        if (command.to < 0)
+        {
+            from = alarm_sched_now(scheduler);
+            to = from + command.from * 1000;
+        }
+        else
+        {
+            from = (long long)command.from * 1000;
+            to = (long long)command.to * 1000 + 999;
+        }
+        count = alarm_sched_window(scheduler, from, to, command.group_id,
+                                   list_alarm, out);
+        if (command.group_id < 0)
+            fprintf(out, "Queried %d Alarms Firing from %ld to %ld\n",
+                    count, (long)(from / 1000), (long)(to / 1000));
+        else
+            fprintf(out, "Queried %d Alarms in Group(%d) Firing from %ld to %ld\n",
+                    count, command.group_id, (long)(from / 1000), (long)(to / 1000));
+        break;
+    case COMMAND_STATS:
+        alarm_sched_stats(scheduler, &stats);
+        fprintf(out, "Wakeups: %lu necessary, %lu spurious; Signals: %lu sent, %lu avoided\n",
+                stats.necessary, stats.spurious,
+                stats.signals, stats.quiet);
+        if (stats.capacity == 0)
+            fprintf(out, "Alarms: %u pending, %u at peak\n",
+                    stats.pending, stats.peak);
+        else
+            fprintf(out, "Alarms: %u pending, %u at peak, %u allowed; %lu rejected, %lu shed, %lu waited, %u waiting\n",
+                    stats.pending, stats.peak, stats.capacity,
+                    stats.rejected, stats.shed, stats.blocked, stats.waiting);
+        if (handoff != NULL)
+            fprintf(out, "Timer Thread: %lu allocations, %lu waits for display\n",
+                    stats.timer_allocs, handoff->waits);
+        break;
+    case COMMAND_START:
+    case COMMAND_PERIODIC:
+        interval = command.op == COMMAND_PERIODIC ? command.seconds : 0;
+        status = alarm_sched_start_text(scheduler, command.alarm_id,
+                                        command.group_id, command.seconds,
+                                        interval, command.slack,
+                                        command.priority, command.message,
+                                        command.length, &info);
+        if (status == EEXIST)
+            fprintf(err, "Alarm(%d) Already Exists\n", command.alarm_id);
+        else if (status == EAGAIN)
+            fprintf(err, "Alarm(%d) Not Inserted: Too Many Alarms\n", command.alarm_id);
+        else if (status == ENOMEM)
+            err_abort(status, "Start alarm");
+        else if (status != 0)
+            fprintf(err, "Bad command\n");
+        else
+            fprintf(out, "Alarm(%d) Inserted by Main Thread %d Into Alarm List at %d: Group(%d) %ld %s\n", command.alarm_id, pthread_self(), info.seconds, info.group_id, (long)info.time, info.message);
+        alarm_sched_info_release(scheduler, &info);
+        break;
+    case COMMAND_CHANGE:
+        status = alarm_sched_change_text(scheduler, command.alarm_id,
+                                         command.group_id, command.seconds,
+                                         command.message, command.length,
+                                         &info);
+        if (status == ENOENT)
+            fprintf(err, "Alarm(%d) Not Found\n", command.alarm_id);
+        else if (status == ENOMEM)
+            err_abort(status, "Change alarm");
+        else if (status != 0)
+            fprintf(err, "Bad command\n");
+        else if (info.group_id != command.group_id)
+            fprintf(out,"Display Thread <thread-id> Has Stopped Printing Message of Alarm(%d at %ld: Changed Group(%d) %.*s\n",
+                command.alarm_id, (long)info.time, command.group_id,
+                (int)command.length, command.message);
+        else
+            fprintf(out,"Alarm(%d) Changed at %ld: Group(%d) %.*s\n",
+                command.alarm_id, (long)(alarm_sched_now(scheduler) / 1000),
+                command.group_id, (int)command.length, command.message);
+        alarm_sched_info_release(scheduler, &info);
+        break;
+    case COMMAND_BULK:
+        /*
+         * One pass under one hold of the lock, and one line for
+         * the lot instead of one per alarm moved.
+         */
+        bulk.low = command.alarm_id;
+        bulk.high = command.last;
+        bulk.group_id = command.group_id;
+        bulk.new_group = command.new_group;
+        bulk.seconds = command.seconds;
+        count = alarm_sched_bulk(scheduler, &bulk);
+        if (count < 0 && errno == ENOMEM)
+            errno_abort("Change alarms");
+        if (count < 0)
+            fprintf(err, "Bad command\n");
+        else if (command.new_group >= 0)
+            fprintf(out, "Display Thread <thread-id> Has Stopped Printing Messages of %d Alarms(%d-%d) at %ld: Changed Group(%d)\n",
+                count, command.alarm_id, command.last,
+                (long)(alarm_sched_now(scheduler) / 1000), command.new_group);
+        else
+            fprintf(out, "%d Alarms(%d-%d) Changed at %ld\n",
+                count, command.alarm_id, command.last,
+                (long)(alarm_sched_now(scheduler) / 1000));
+        break;
+    default:
+        fprintf(err, "Bad command\n");
+    }
+}
+
+/*
+ * Unix domain socket command server (-u path). Any number of
+ * local processes may connect and send the same commands as the
+ * console, one per line; each gets the replies to its own
+ * commands back on its connection. A single thread serves every
+ * client with poll() over non-blocking sockets and hands complete
+ * lines straight to alarm_command, so socket traffic never passes
+ * through the console loop in main.
+ *
+ * CLIENT_LINE_MAX is the size of a client's input buffer, so the
+ * longest line a client may send is one byte less, newline
+ * included; longer ones are rejected. This limit is the socket's
+ * alone: the console reads whole CONSOLE_BUFFER blocks.
+ */
+#define CLIENT_LINE_MAX 4096
+
+typedef struct client_tag
+{
+    int fd;
+    int eof;                   /* client has finished sending */
+    int skipping;              /* discarding an overlong line */
+    size_t in_len;
+    char in[CLIENT_LINE_MAX];
+    char *out;                 /* replies not yet written */
+    size_t out_len, out_off, out_size;
+} client_t;
+
+/*
+ * Queue "len" bytes of reply for a client.
+ */
+void client_queue(client_t *client, const char *data, size_t len)
+{
+    char *out;
+
+    if (client->out_off == client->out_len)
+        client->out_off = client->out_len = 0;
+    if (client->out_len + len > client->out_size)
+    {
+        client->out_size = (client->out_len + len) * 2;
+        out = (char *)realloc(client->out, client->out_size);
+        if (out == NULL)
+            errno_abort("Allocate reply");
+        client->out = out;
+    }
+    memcpy(client->out + client->out_len, data, len);
+    client->out_len += len;
+}
+
+/*
+ * Run one command line from a client and queue its replies.
+ */
+void client_command(client_t *client, char *line, size_t line_len)
+{
+    FILE *reply;
+    char *buf;
+    size_t len;
+
+    reply = open_memstream(&buf, &len);
+    if (reply == NULL)
+        errno_abort("Open reply stream");
+    if (line_len > 1)
+        alarm_command(line, line_len, reply, reply);
+    fclose(reply);
+    client_queue(client, buf, len);
+    free(buf);
+}
+
+/*
+ * Read whatever the client has sent and run every complete line.
+ * Sets client->eof once the client has finished sending, and
+ * returns -1 if the connection failed.
+ */
+int client_read(client_t *client)
+{
+    ssize_t count;
+    char *start, *newline, *end;
+
+    while (1)
+    {
+        count = read(client->fd, client->in + client->in_len,
+                     sizeof(client->in) - 1 - client->in_len);
+        if (count == 0)
+        {
+            client->eof = 1;
+            return 0;
+        }
+        if (count < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        client->in_len += count;
+        start = client->in;
+        end = client->in + client->in_len;
+        while ((newline = memchr(start, '\n', end - start)) != NULL)
+        {
+            if (!client->skipping)
+                client_command(client, start, newline + 1 - start);
+            client->skipping = 0;
+            start = newline + 1;
+        }
+        client->in_len = end - start;
+        memmove(client->in, start, client->in_len);
+
+        /*
+         * A line that fills the whole buffer is rejected once and
+         * the rest of it, up to the next newline, is discarded.
+         */
+        if (client->in_len == sizeof(client->in) - 1)
+        {
+            if (!client->skipping)
+                client_queue(client, "Bad command\n", 12);
+            client->skipping = 1;
+            client->in_len = 0;
+        }
+    }
+}
 
-#define UNCHANGED 0
-#define CHANGE 1
-#define CHANGE2 2
 /*
- * The "alarm" structure now contains the time_t (time since the
- * Epoch, in seconds) for each alarm, so that they can be
- * sorted. Storing the requested number of seconds would not be
- * enough, since the "alarm thread" cannot tell how long it has
- * been on the list.
+ * Write as much of the queued replies as the socket will take.
+ * Returns -1 if the client has gone away.
  */
-typedef struct alarm_tag
+int client_write(client_t *client)
 {
-    struct alarm_tag *link;
-    int seconds;
-    int alarm_id;
-    int group_id;
-    int changed;
-    time_t time; /* seconds from EPOCH */
-    char message[64];
-} alarm_t;
-
-pthread_mutex_t alarm_mutex = PTHREAD_MUTEX_INITIALIZER;
-pthread_cond_t alarm_cond = PTHREAD_COND_INITIALIZER;
-alarm_t *alarm_list = NULL;
-alarm_t *curr_alarm_t;
-time_t current_alarm = 0;
+    ssize_t count;
 
-sem_t main_sem;
-sem_t display_sem;
+    while (client->out_off < client->out_len)
+    {
+        count = send(client->fd, client->out + client->out_off,
+                     client->out_len - client->out_off, MSG_NOSIGNAL);
+        if (count < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        client->out_off += count;
+    }
+    return 0;
+}
 
+/*
+ * Create the listening socket at "path", replacing any stale
+ * socket file left by an earlier run.
+ */
+int server_listen(const char *path)
+{
+    struct sockaddr_un addr;
+    int fd;
 
+    if (strlen(path) >= sizeof(addr.sun_path))
+    {
+        fprintf(stderr, "Socket path too long: %s\n", path);
+        exit(1);
+    }
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+        errno_abort("Create socket");
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    unlink(path);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+        errno_abort("Bind socket");
+    if (listen(fd, SOMAXCONN) < 0)
+        errno_abort("Listen on socket");
+    if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) < 0)
+        errno_abort("Set non-blocking");
+    return fd;
+}
 
 /*
- * Insert alarm entry on list, in order.
+ * The server thread's start routine. fds[0] is the listening
+ * socket; fds[i] for i > 0 belongs to clients[i].
  */
-void alarm_insert(alarm_t *alarm)
+void *server_thread(void *arg)
 {
-    int status;
-    alarm_t **last, *next;
+    struct pollfd *fds;
+    client_t **clients;
+    client_t *client;
+    int count, size, i, fd;
 
-    /*
-     * LOCKING PROTOCOL:
-     *
-     * This routine requires that the caller have locked the
-     * alarm_mutex!
-     */
-    last = &alarm_list;
-    next = *last;
-    while (next != NULL)
+    size = 16;
+    fds = (struct pollfd *)malloc(size * sizeof(struct pollfd));
+    clients = (client_t **)malloc(size * sizeof(client_t *));
+    if (fds == NULL || clients == NULL)
+        errno_abort("Allocate clients");
+    fds[0].fd = *(int *)arg;
+    fds[0].events = POLLIN;
+    clients[0] = NULL;
+    count = 1;
+
+    while (1)
     {
-        if (next->alarm_id >= alarm->alarm_id)
+        if (poll(fds, count, -1) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            errno_abort("Poll");
+        }
+
+        /*
+         * Serve clients first. A client that has finished sending
+         * is dropped once its replies are written, by moving the
+         * last entry into its slot.
+         */
+        for (i = count - 1; i > 0; i--)
+        {
+            client = clients[i];
+            if (fds[i].revents & (POLLIN | POLLHUP | POLLERR))
+            {
+                if (client_read(client) < 0)
+                    client->fd = -1;
+            }
+            if (client->fd >= 0 && client_write(client) < 0)
+                client->fd = -1;
+            if (client->eof && client->out_off == client->out_len)
+                client->fd = -1;
+            if (client->fd < 0)
+            {
+                close(fds[i].fd);
+                free(client->out);
+                free(client);
+                count--;
+                fds[i] = fds[count];
+                clients[i] = clients[count];
+                continue;
+            }
+            fds[i].events = client->eof ? 0 : POLLIN;
+            if (client->out_off < client->out_len)
+                fds[i].events |= POLLOUT;
+        }
+
+        if (!(fds[0].revents & POLLIN))
+            continue;
+        while ((fd = accept(fds[0].fd, NULL, NULL)) >= 0)
         {
-            alarm->link = next;
-            *last = alarm;
-            curr_alarm_t = next;
+            if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) < 0)
+                errno_abort("Set non-blocking");
+            if (count == size)
+            {
+                size *= 2;
+                fds = (struct pollfd *)realloc(fds, size * sizeof(struct pollfd));
+                clients = (client_t **)realloc(clients, size * sizeof(client_t *));
+                if (fds == NULL || clients == NULL)
+                    errno_abort("Allocate clients");
+            }
+            client = (client_t *)calloc(1, sizeof(client_t));
+            if (client == NULL)
+                errno_abort("Allocate client");
+            client->fd = fd;
+            fds[count].fd = fd;
+            fds[count].events = POLLIN;
+            fds[count].revents = 0;
+            clients[count] = client;
+            count++;
+        }
+    }
+}
+
+/*
+ * Shared-memory submission ring (-r name); see alarm_ring.h for
+ * the layout and the producer side. The ring thread below is its
+ * only consumer.
+ */
+#define ALARM_RING_BATCH 256
+#define ALARM_RING_SPIN  20000  /* empty polls before sleeping */
+
+/*
+ * Create (or re-create) the ring as POSIX shared memory object
+ * "name" and map it.
+ */
+alarm_ring_t *ring_create(const char *name)
+{
+    alarm_ring_t *ring;
+    unsigned i;
+    int fd;
+
+    shm_unlink(name);
+    fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd < 0)
+        errno_abort("Create ring");
+    if (ftruncate(fd, sizeof(alarm_ring_t)) < 0)
+        errno_abort("Size ring");
+    ring = (alarm_ring_t *)mmap(NULL, sizeof(alarm_ring_t),
+        PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (ring == MAP_FAILED)
+        errno_abort("Map ring");
+    close(fd);
+
+    for (i = 0; i < ALARM_RING_SLOTS; i++)
+        atomic_init(&ring->slot[i].seq, i);
+    atomic_init(&ring->tail, 0);
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->sleeping, 0);
+    atomic_init(&ring->doorbell, 0);
+    ring->slots = ALARM_RING_SLOTS;
+    atomic_thread_fence(memory_order_release);
+    ring->magic = ALARM_RING_MAGIC;
+    return ring;
+}
+
+/*
+ * Number of published requests, up to "max", waiting at the head
+ * of the ring.
+ */
+int ring_ready(alarm_ring_t *ring, unsigned long head, int max)
+{
+    alarm_ring_slot_t *slot;
+    int count;
+
+    for (count = 0; count < max; count++)
+    {
+        slot = &ring->slot[(head + count) & (ALARM_RING_SLOTS - 1)];
+        if (atomic_load_explicit(&slot->seq, memory_order_acquire)
+            != head + count + 1)
             break;
+    }
+    return count;
+}
+
+/*
+ * The ring thread's start routine. It takes whatever requests are
+ * waiting, up to ALARM_RING_BATCH, and submits them to the
+ * scheduler as one batch. When the ring stays empty for
+ * ALARM_RING_SPIN polls it sleeps on the doorbell futex; the spin keeps producers in a steady stream
+ * from paying for a wakeup system call on every request.
+ */
+void *ring_thread(void *arg)
+{
+    alarm_ring_t *ring = (alarm_ring_t *)arg;
+    unsigned long head;
+    unsigned doorbell;
+    alarm_request_t batch[ALARM_RING_BATCH];
+    int results[ALARM_RING_BATCH];
+    int count, i, idle;
+
+    head = atomic_load(&ring->head);
+    idle = 0;
+    while (1)
+    {
+        count = ring_ready(ring, head, ALARM_RING_BATCH);
+        if (count == 0 && ++idle < ALARM_RING_SPIN)
+            continue;
+        if (count == 0)
+        {
+            /*
+             * Announce that we are going to sleep, then look once
+             * more: a producer that published before seeing
+             * "sleeping" is caught here, and one that publishes
+             * after will ring the doorbell.
+             */
+            doorbell = atomic_load(&ring->doorbell);
+            atomic_store(&ring->sleeping, 1);
+            if (ring_ready(ring, head, 1) == 0)
+                syscall(SYS_futex, &ring->doorbell, FUTEX_WAIT,
+                        doorbell, NULL, NULL, 0);
+            atomic_store(&ring->sleeping, 0);
+            idle = 0;
+            continue;
+        }
+        idle = 0;
+
+        /*
+         * Copy the batch out of the ring so that its slots can be
+         * released; the library takes the whole batch under one
+         * hold of its lock. Ring producers get no replies, so
+         * only failures are reported, on stderr.
+         */
+        for (i = 0; i < count; i++)
+        {
+            batch[i] = ring->slot[(head + i) & (ALARM_RING_SLOTS - 1)].request;
+            batch[i].text = NULL;   /* a pointer from another process */
+        }
+        for (i = 0; i < count; i++)
+            atomic_store_explicit(
+                &ring->slot[(head + i) & (ALARM_RING_SLOTS - 1)].seq,
+                head + i + ALARM_RING_SLOTS, memory_order_release);
+        head += count;
+        atomic_store(&ring->head, head);
+
+        alarm_sched_submit(scheduler, batch, count, results);
+        for (i = 0; i < count; i++)
+        {
+            if (results[i] == EEXIST)
+                fprintf(stderr, "Alarm(%d) Already Exists\n", batch[i].alarm_id);
+            else if (results[i] == EAGAIN)
+                fprintf(stderr, "Alarm(%d) Not Inserted: Too Many Alarms\n", batch[i].alarm_id);
+            else if (results[i] == ENOENT)
+                fprintf(stderr, "Alarm(%d) Not Found\n", batch[i].alarm_id);
+            else if (results[i] == ENOMEM)
+                err_abort(results[i], "Submit ring requests");
+            else if (results[i] != 0)
+                fprintf(stderr, "Bad ring request\n");
         }
-        last = &next->link;
-        next = next->link;
     }
-    /*
-     * If we reached the end of the list, insert the new alarm
-     * there.  ("next" is NULL, and "last" points to the link
-     * field of the last item, or to the list header.)
-     */
-    if (next == NULL)
+}
+
+/*
+ * Bulk ingestion (--ingest). Every file named with -i is mapped and
+ * cut at line boundaries into "parts" pieces, and each piece gets
+ * a thread of its own that splits and parses its lines and hands
+ * them to the scheduler INGEST_BATCH at a time with
+ * alarm_sched_submit. Parsing therefore runs on as many cores as
+ * there are pieces, and the scheduler lock is taken once per batch
+ * rather than once per command. Each piece is applied in order,
+ * but pieces run in no particular order relative to one another.
+ *
+ * Commands that succeed are not echoed; failures are reported on
+ * stderr as the console reports them.
+ */
+#define INGEST_BATCH 256
+#define INGEST_WINDOW 65536
+
+typedef struct ingest_tag
+{
+    pthread_t thread;
+    char *start, *end;          /* the lines of this piece */
+    uint64_t newlines[INGEST_WINDOW / 64];
+    alarm_request_t batch[INGEST_BATCH];
+    int results[INGEST_BATCH];
+    int count;
+} ingest_t;
+
+void ingest_flush(ingest_t *ingest)
+{
+    alarm_request_t *request;
+    int i;
+
+    if (ingest->count == 0)
+        return;
+    alarm_sched_submit(scheduler, ingest->batch, ingest->count,
+                       ingest->results);
+    for (i = 0; i < ingest->count; i++)
     {
-        *last = alarm;
-        alarm->link = NULL;
+        request = &ingest->batch[i];
+        if (ingest->results[i] == EEXIST)
+            fprintf(stderr, "Alarm(%d) Already Exists\n", request->alarm_id);
+        else if (ingest->results[i] == EAGAIN)
+            fprintf(stderr, "Alarm(%d) Not Inserted: Too Many Alarms\n", request->alarm_id);
+        else if (ingest->results[i] == ENOENT)
+            fprintf(stderr, "Alarm(%d) Not Found\n", request->alarm_id);
+        else if (ingest->results[i] == ENOMEM)
+            err_abort(ingest->results[i], "Submit commands");
+        else if (ingest->results[i] != 0)
+            fprintf(stderr, "Bad command\n");
     }
-#ifdef DEBUG
-    printf("[list: ");
-    for (next = alarm_list; next != NULL; next = next->link)
-        printf("%d(%d)[\"%s\"] ", next->time,
-               next->time - time(NULL), next->message);
-    printf("]\n");
-#endif
-    /*
-     * Wake the alarm thread if it is not busy (that is, if
-     * current_alarm is 0, signifying that it's waiting for
-     * work), or if the new alarm comes before the one on
-     * which the alarm thread is waiting.
-     */
-    if (current_alarm == 0 || alarm->time < current_alarm)
+    ingest->count = 0;
+}
+
+/*
+ * Parse one line into the next request of the batch. Messages are
+ * passed by pointer and length into the mapped file, which
+ * outlives the submit that copies them, so the file is never
+ * written and its pages are never copied.
+ */
+void ingest_line(ingest_t *ingest, char *line, size_t len)
+{
+    alarm_request_t *request;
+    command_t command;
+
+    if (len == 0 || *line == '\n')
+        return;
+    switch (command_parse(line, len, &command))
     {
-        current_alarm = alarm->time;
-        status = pthread_cond_signal(&alarm_cond);
-        if (status != 0)
-            err_abort(status, "Signal cond");
+    case COMMAND_START:
+    case COMMAND_PERIODIC:
+    case COMMAND_CHANGE:
+    case COMMAND_CANCEL:
+        request = &ingest->batch[ingest->count];
+        request->op = command.op == COMMAND_START ? ALARM_OP_START
+            : command.op == COMMAND_PERIODIC ? ALARM_OP_PERIODIC
+            : command.op == COMMAND_CHANGE ? ALARM_OP_CHANGE : ALARM_OP_CANCEL;
+        request->alarm_id = command.alarm_id;
+        request->group_id = command.group_id;
+        request->seconds = command.seconds;
+        request->slack = command.slack;
+        request->priority = command.priority;
+        request->text = command.message;
+        request->length = command.length;
+        request->message[0] = '\0';
+        if (++ingest->count == INGEST_BATCH)
+            ingest_flush(ingest);
+        break;
+    case COMMAND_BAD:
+        fprintf(stderr, "Bad command\n");
+        break;
+    default:
+        /*
+         * The rest ("slack:", "stats", "list(") go through alarm_command
+         * after the batch so far, so that they see it applied.
+         * alarm_command only reads the line, so it is passed where
+         * it lies in the map.
+         */
+        ingest_flush(ingest);
+        alarm_command(line, len, stdout, stderr);
+        break;
     }
 }
 
+void *ingest_thread(void *arg)
+{
+    ingest_t *ingest = (ingest_t *)arg;
+    uint64_t bits;
+    char *start, *newline;
+    size_t size, offset, window, word;
+
+    size = ingest->end - ingest->start;
+    start = ingest->start;
+    for (offset = 0; offset < size; offset += window)
+    {
+        window = size - offset < INGEST_WINDOW ? size - offset : INGEST_WINDOW;
+        scan_newlines(ingest->start + offset, window, ingest->newlines);
+        for (word = 0; word * 64 < window; word++)
+        {
+            for (bits = ingest->newlines[word]; bits != 0; bits &= bits - 1)
+            {
+                newline = ingest->start + offset + word * 64 + __builtin_ctzll(bits);
+                ingest_line(ingest, start, newline + 1 - start);
+                start = newline + 1;
+            }
+        }
+    }
+
+    if (start < ingest->end)
+        ingest_line(ingest, start, ingest->end - start);
+    ingest_flush(ingest);
+    return NULL;
+}
 
-void getSmallestAlarmTime(){
-    alarm_t *smallestAlarm, *next, *current_alarm;
-    alarm_t *last;
-    int beenRemoved;
+/*
+ * Load every file in "paths", each in "parts" pieces on threads of
+ * their own, and return once all are in.
+ */
+void ingest_files(char **paths, int files, int parts)
+{
+    ingest_t *ingest;
+    char **maps, *cut, *end;
+    size_t *sizes;
+    struct stat st;
+    int fd, f, p, count, status;
 
-    smallestAlarm = alarm_list;
-    next = alarm_list;
-    last = NULL;
+    ingest = (ingest_t *)malloc(files * parts * sizeof(ingest_t));
+    maps = (char **)malloc(files * sizeof(char *));
+    sizes = (size_t *)malloc(files * sizeof(size_t));
+    if (ingest == NULL || maps == NULL || sizes == NULL)
+        errno_abort("Allocate ingest threads");
 
-    while (next->link != NULL)
+    count = 0;
+    for (f = 0; f < files; f++)
     {
-        if (next->time < smallestAlarm->time){
-            smallestAlarm = next;
+        fd = open(paths[f], O_RDONLY);
+        if (fd < 0)
+            errno_abort("Open ingest file");
+        if (fstat(fd, &st) < 0)
+            errno_abort("Stat ingest file");
+        sizes[f] = st.st_size;
+        maps[f] = NULL;
+        if (sizes[f] > 0)
+        {
+            maps[f] = mmap(NULL, sizes[f], PROT_READ, MAP_PRIVATE, fd, 0);
+            if (maps[f] == MAP_FAILED)
+                errno_abort("Map ingest file");
+        }
+        close(fd);
+
+        /*
+         * Cut after the first newline at or past each even share,
+         * so that every piece holds whole lines.
+         */
+        end = maps[f] + sizes[f];
+        cut = maps[f];
+        for (p = 1; p <= parts && cut < end; p++)
+        {
+            ingest[count].start = cut;
+            cut = p == parts ? end : maps[f] + sizes[f] / parts * p;
+            if (cut < ingest[count].start)
+                cut = ingest[count].start;
+            cut = memchr(cut, '\n', end - cut);
+            cut = cut == NULL ? end : cut + 1;
+            ingest[count].end = cut;
+            ingest[count].count = 0;
+            count++;
         }
-        next = next->link;
     }
 
-    if (next->time < smallestAlarm->time){
-        smallestAlarm = next;
+    for (p = 0; p < count; p++)
+    {
+        status = pthread_create(&ingest[p].thread, NULL, ingest_thread, &ingest[p]);
+        if (status != 0)
+            err_abort(status, "Create ingest thread");
     }
+    for (p = 0; p < count; p++)
+    {
+        status = pthread_join(ingest[p].thread, NULL);
+        if (status != 0)
+            err_abort(status, "Join ingest thread");
+    }
+    for (f = 0; f < files; f++)
+        if (maps[f] != NULL)
+            munmap(maps[f], sizes[f]);
+    fflush(stdout);
+    free(ingest);
+    free(maps);
+    free(sizes);
+}
+
+/*
+ * Replay of a recorded command log (--replay). Each line is a
+ * command as typed at the console, optionally preceded by the time
+ * it was issued, in seconds from EPOCH to the msec:
+ *
+ *      1792368787.250 start(1): group(2) 5 hi
+ *
+ * The log is mapped read-only and parsed in place, a
+ * REPLAY_WINDOW of newlines at a time, so nothing is read() or
+ * copied. Each line is applied when its time comes round again,
+ * counted from the first stamped line and divided by "speed";
+ * speed 0 applies the whole log as fast as it parses. A line with
+ * no time goes with the line before it.
+ *
+ * On a virtual clock (--virtual) nothing waits: the scheduler's
+ * clock starts at the log's first time and is advanced to each
+ * line's time before the line is applied, firing whatever falls
+ * due in between, and after the last line it runs on until every
+ * one-shot alarm has fired.
+ */
+#define REPLAY_WINDOW 65536
 
-    current_alarm = smallestAlarm;
+typedef struct replay_tag
+{
+    char *log;                  /* the mapped log */
+    size_t size;
+    int virtual;                /* on an ALARM_CLOCK_VIRTUAL scheduler */
+    double speed;               /* time compression; 0 for none */
+    long long first;            /* msec; time of the first stamped line */
+    struct timespec origin;     /* CLOCK_MONOTONIC when it was applied */
+} replay_t;
 
-    next = alarm_list;
-    beenRemoved=0;
+/*
+ * The time stamp at the start of a line, in msec, or -1 if there
+ * is none. On success *line is moved past it.
+ */
+long long replay_stamp(char **line, char *end)
+{
+    char *p = *line;
+    long long msec;
+    int digits;
 
-    while(next!=NULL && beenRemoved!=1){
-        if(next->time == smallestAlarm->time){
-            if(last == NULL){
-                alarm_list = next->link;
-            }
-            else{
-                last->link = next->link;
-            }
-        beenRemoved = 1;
+    msec = 0;
+    for (digits = 0; p < end && *p >= '0' && *p <= '9'; digits++)
+        msec = msec * 10 + (*p++ - '0');
+    if (digits == 0)
+        return -1;
+    msec *= 1000;
+    if (p < end && *p == '.')
+    {
+        for (p++, digits = 100; p < end && *p >= '0' && *p <= '9'; p++, digits /= 10)
+            msec += (*p - '0') * digits;
+    }
+    if (p == end || (*p != ' ' && *p != '\t'))
+        return -1;
+    *line = p;
+    return msec;
+}
+
+/*
+ * Wait for a line's time to come round, then carry it out.
+ */
+void replay_line(replay_t *replay, char *line, size_t len)
+{
+    char *end = line + len;
+    struct timespec target;
+    long long stamp, delay;
+    int status;
+
+    stamp = replay_stamp(&line, end);
+    if (stamp >= 0 && replay->virtual)
+    {
+        if (alarm_sched_advance(scheduler, stamp) < 0)
+            errno_abort("Advance clock");
+    }
+    else if (stamp >= 0 && replay->speed > 0)
+    {
+        if (replay->first < 0)
+        {
+            replay->first = stamp;
+            clock_gettime(CLOCK_MONOTONIC, &replay->origin);
         }
-        if(next->link!=NULL){
-            last=next;
-            next=next->link;
+        delay = (long long)((stamp - replay->first) / replay->speed);
+        if (delay > 0)
+        {
+            target.tv_sec = replay->origin.tv_sec + delay / 1000;
+            target.tv_nsec = replay->origin.tv_nsec + (delay % 1000) * 1000000;
+            if (target.tv_nsec >= 1000000000)
+            {
+                target.tv_sec++;
+                target.tv_nsec -= 1000000000;
+            }
+            fflush(stdout);
+            while ((status = clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME,
+                                             &target, NULL)) == EINTR)
+                ;
+            if (status != 0)
+                err_abort(status, "Wait for replay time");
         }
     }
+    while (line < end && (*line == ' ' || *line == '\t'))
+        line++;
+    if (line < end && *line != '\n')
+        alarm_command(line, end - line, stdout, stderr);
 }
 
+/*
+ * Map the log read-only: alarm_command parses each line where it
+ * lies.
+ */
+void replay_open(replay_t *replay, const char *path)
+{
+    struct stat st;
+    int fd;
 
-
+    replay->log = NULL;
+    replay->first = -1;
+    fd = open(path, O_RDONLY);
+    if (fd < 0)
+        errno_abort("Open replay log");
+    if (fstat(fd, &st) < 0)
+        errno_abort("Stat replay log");
+    replay->size = st.st_size;
+    if (replay->size > 0)
+    {
+        replay->log = mmap(NULL, replay->size, PROT_READ, MAP_PRIVATE,
+                           fd, 0);
+        if (replay->log == MAP_FAILED)
+            errno_abort("Map replay log");
+        madvise(replay->log, replay->size, MADV_SEQUENTIAL);
+    }
+    close(fd);
+}
 
 /*
-  A.3.2.2
-  Change alarm specified by alarm_id
-  group_id to new specified group_id
-  time to new specified time
-  message to new specified message
-*/
-void change_alarm(alarm_t *new)
+ * The time of the first stamped line, in msec, or the time now if
+ * no line has one.
+ */
+long long replay_start(replay_t *replay)
 {
-    alarm_t **last, *next;
+    char *line, *end, *newline;
+    long long stamp;
 
-    int status;
+    end = replay->log + replay->size;
+    for (line = replay->log; line < end; line = newline + 1)
+    {
+        newline = memchr(line, '\n', end - line);
+        if (newline == NULL)
+            newline = end;
+        stamp = replay_stamp(&line, newline);
+        if (stamp >= 0)
+            return stamp;
+    }
+    return (long long)time(NULL) * 1000;
+}
 
-    last = &alarm_list;
-    next = *last;
+void replay_run(replay_t *replay)
+{
+    static uint64_t newlines[REPLAY_WINDOW / 64];
+    uint64_t bits;
+    char *log, *start, *newline;
+    size_t size, offset, window, word;
 
-    status=sem_wait(&main_sem);
-    if (status != 0)
+    log = replay->log;
+    size = replay->size;
+    start = log;
+    for (offset = 0; offset < size; offset += window)
     {
-        err_abort(status,"Lock mutex");
+        window = size - offset < REPLAY_WINDOW ? size - offset : REPLAY_WINDOW;
+        scan_newlines(log + offset, window, newlines);
+        for (word = 0; word * 64 < window; word++)
+        {
+            for (bits = newlines[word]; bits != 0; bits &= bits - 1)
+            {
+                newline = log + offset + word * 64 + __builtin_ctzll(bits);
+                replay_line(replay, start, newline + 1 - start);
+                start = newline + 1;
+            }
+        }
     }
 
-    while (next != NULL)
+    /*
+     * A last line without a newline is still a command.
+     */
+    if (start < log + size)
+        replay_line(replay, start, log + size - start);
+    if (log != NULL)
+        munmap(log, size);
+    if (replay->virtual && alarm_sched_advance(scheduler, ALARM_CLOCK_DRAIN) < 0)
+        errno_abort("Advance clock");
+    fflush(stdout);
+}
+
+/*
+ * Console input is read in CONSOLE_BUFFER blocks with read() and
+ * split into lines in place: scan_newlines marks every newline in
+ * the block in one pass, each is overwritten with a NUL and the
+ * line handed to alarm_command where it lies, so a batch load is
+ * not copied line by line through stdio. Replies are flushed
+ * before every read, keeping them in step with the prompts when
+ * stdout is a pipe.
+ */
+#define CONSOLE_BUFFER 65536
+
+void console_loop(void)
+{
+    static char in[CONSOLE_BUFFER];
+    static uint64_t newlines[CONSOLE_BUFFER / 64];
+    uint64_t bits;
+    size_t len, word;
+    ssize_t count;
+    char *start, *newline;
+    int skipping;
+
+    len = 0;
+    skipping = 0;
+    printf("Alarm> ");
+    while (1)
     {
-        if (next->alarm_id == new->alarm_id)
+        fflush(stdout);
+        count = read(STDIN_FILENO, in + len, sizeof(in) - 1 - len);
+        if (count < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            errno_abort("Read commands");
+        }
+        if (count == 0)
         {
-            if (next->group_id == new->group_id){
-                strcpy(next->message, new->message);
-                next->changed = CHANGE;
-                curr_alarm_t = next;
-                next->time = time(NULL) + new->time;
-                new->link = next;
+            /*
+             * A last line without a newline is still a command.
+             */
+            if (len > 0 && !skipping)
+            {
+                in[len] = '\0';
+                alarm_command(in, len, stdout, stderr);
             }
-            else{
-                next->changed = CHANGE2;
-                next->group_id = new->group_id;
-                next->time = time(NULL) + new->time;
-                strcpy(next->message, new->message);
-                new->link = next;
+            fflush(stdout);
+            handoff_flush();
+            display_flush();
+            exit(0);
+        }
+        len += count;
+        scan_newlines(in, len, newlines);
+        start = in;
+        for (word = 0; word * 64 < len; word++)
+        {
+            for (bits = newlines[word]; bits != 0; bits &= bits - 1)
+            {
+                newline = in + word * 64 + __builtin_ctzll(bits);
+                *newline = '\0';
+                if (!skipping && newline != start)
+                    alarm_command(start, newline - start, stdout, stderr);
+                skipping = 0;
+                printf("Alarm> ");
+                start = newline + 1;
             }
-            break;
         }
-        last = &next->link;
-        next = next->link;
+        len = in + len - start;
+        memmove(in, start, len);
+
+        /*
+         * A line that fills the whole buffer is rejected once and
+         * the rest of it, up to the next newline, is discarded.
+         */
+        if (len == sizeof(in) - 1)
+        {
+            if (!skipping)
+                fprintf(stderr, "Bad command\n");
+            skipping = 1;
+            len = 0;
+        }
     }
+}
 
-#ifdef DEBUG
-       printf ("[list: ");
-       for (next = alarm_list; next != NULL; next = next->link)
-           printf ("(%d)[\"%s\"] ", next->change, next->message);
-        printf ("]\n");
-#endif
-    if (curr_alarm_t->alarm_id == new->alarm_id) {
-       if(curr_alarm_t->group_id != new->group_id) {
-          fprintf(stdout,"Display Thread <thread-id> Has Stopped Printing Message of Alarm(%d at %ld: Changed Group(%d) %s\n",
-          new->alarm_id, curr_alarm_t->time, new->group_id, new->message);
-        }
-      else {
-          fprintf(stdout,"Alarm(%d) Changed at %ld: Group(%d) %s\n",
-                  new->alarm_id, time (NULL), new->group_id, new->message);
-        }
-        alarm_insert(new);
-        getSmallestAlarmTime();
-      }
-    else{
-        alarm_insert(new);
-    }
-    
-    status=sem_post(&main_sem);
-    if (status != 0)
+/*
+ * Parse a CPU list such as "0-3,8,10-11" into "cpus". Returns 0,
+ * or -1 if the list is malformed or names no CPU.
+ */
+int cpu_parse(const char *list, cpu_set_t *cpus)
+{
+    char *end;
+    long first, last;
+
+    CPU_ZERO(cpus);
+    while (1)
     {
-        err_abort(status,"Unlock mutex");
-    }
-}
-
-
- void *alarm_thread (void *arg)
-  {
-      alarm_t *alarm, *next;
-      struct timespec cond_time;
-      time_t now;
-      int status, expired;
-
-      /*
-       * Loop forever, processing commands. The alarm thread will
-       * be disintegrated when the process exits. Lock the mutex
-       * at the start -- it will be unlocked during condition
-       * waits, so the main thread can insert alarms.
-       */
-      status = pthread_mutex_lock (&alarm_mutex);
-      if (status != 0)
-          err_abort (status, "Lock mutex");
-      while (1) {
-          /*
-           * If the alarm list is empty, wait until an alarm is
-           * added. Setting current_alarm to 0 informs the insert
-           * routine that the thread is not busy.
-           */
-          current_alarm = 0;
-          while (alarm_list == NULL) {
-              status = pthread_cond_wait (&alarm_cond, &alarm_mutex);
-              if (status != 0)
-                  err_abort (status, "Wait on cond");
-          }
-
-          curr_alarm_t = alarm_list;
-
-          getSmallestAlarmTime();
-  #ifdef DEBUG
-          next = alarm_list;
-          printf ("[list: ");
-          for (next = alarm_list; next != NULL; next = next->link)
-              printf ("(%d)[\"%s\"] ", next->change,
-              next->message);
-          printf ("]\n");
-  #endif
-        now = time (NULL);
-          expired = 0;
-
-if (curr_alarm_t->time > now) {
-  #ifdef DEBUG
-              printf ("[waiting: %d(%d)\"%s\"]\n", curr_alarm->time,
-                  curr_alarm->time - time (NULL), curr_alarm->message);
-  #endif
-
-   cond_time.tv_sec = curr_alarm_t->time;
-              cond_time.tv_nsec = 0;
-              current_alarm = curr_alarm_t->time;
-              while (current_alarm == curr_alarm_t->time) {
-                  status = pthread_cond_timedwait (
-                      &alarm_cond, &alarm_mutex, &cond_time);
-                  if (status == ETIMEDOUT) {
-                      expired = 1;
-                      break;
-                  }
-                  if (status != 0)
-                      err_abort (status, "Cond timedwait");
-              }
-              if (!expired)
-                  alarm_insert(curr_alarm_t);
-                  } else
-              expired = 1;
-          if (expired) {
-              printf ("(%d) %s\n", curr_alarm_t->seconds, curr_alarm_t->message);
-              free (curr_alarm_t);
-          }
-      }
-  }
-/*
- * The alarm thread's start routine.
- */
-// void *alarm_thread(void *arg)
-// {
-//     struct timespec cond_time;
-//     time_t now;
-//     int status, expired;
-//     pthread_t pthread;
-
-//     /*
-//      * Loop forever, processing commands. The alarm thread will
-//      * be disintegrated when the process exits. Lock the mutex
-//      * at the start -- it will be unlocked during condition
-//      * waits, so the main thread can insert alarms.
-//      */
-//     status = sem_wait(&main_sem);
-//     if (status != 0)
-//         err_abort(status, "Lock mutex");
-
-
-//     while (1)
-//     {
-//         /*
-//          * If the alarm list is empty, wait until an alarm is
-//          * added. Setting current_alarm to 0 informs the insert
-//          * routine that the thread is not busy.
-//          */
-//         current_alarm = 0;
-//         while (alarm_list == NULL)
-//         {
-//             status = pthread_cond_wait(&alarm_cond, &alarm_mutex);
-//             if (status != 0)
-//                 err_abort(status, "Wait on cond");
-//         }
-//         curr_alarm_t = alarm_list;
-
-//         getSmallestAlarmTime();
-
-//         expired = 0;
-//         if (curr_alarm_t->time > now)
-//         {
-// #ifdef DEBUG
-//             printf("[waiting: %d(%d)\"%s\"]\n", curr_alarm_t->time,
-//                    curr_alarm_t->time - time(NULL), curr_alarm_t->message);
-// #endif
-//             cond_time.tv_sec = curr_alarm_t->time;
-//             cond_time.tv_nsec = 0;
-//             current_alarm = curr_alarm_t->time;
-//             while (current_alarm == curr_alarm_t->time)
-//             {
-//                 status = pthread_cond_timedwait(
-//                     &alarm_cond, &alarm_mutex, &cond_time);
-//                 if (status == ETIMEDOUT)
-//                 {
-//                     expired = 1;
-//                     break;
-//                 }
-//                 if (status != 0)
-//                     err_abort(status, "Cond timedwait");
-//             }
-//             if (!expired)
-//                 alarm_insert(curr_alarm_t);
-//         }
-//         else
-//             expired = 1;
-//         if (expired)
-//         {
-//             fprintf(stdout,"(%d) %s\n", curr_alarm_t->seconds, curr_alarm_t->message);
-//             free(curr_alarm_t);
-//         }
-//     }
-// }
+        first = strtol(list, &end, 10);
+        if (end == list || first < 0)
+            return -1;
+        last = first;
+        if (*end == '-')
+        {
+            list = end + 1;
+            last = strtol(list, &end, 10);
+            if (end == list || last < first)
+                return -1;
+        }
+        if (last >= CPU_SETSIZE)
+            return -1;
+        for (; first <= last; first++)
+            CPU_SET(first, cpus);
+        if (*end == '\0')
+            break;
+        if (*end != ',')
+            return -1;
+        list = end + 1;
+    }
+    return CPU_COUNT(cpus) > 0 ? 0 : -1;
+}
 
 int main(int argc, char *argv[])
 {
     int status;
-    char line[128];
-    alarm_t *alarm;
+    long alarm_slack = 0;
     pthread_t thread;
+    int opt, listener;
+    char *socket_path = NULL;
+    char *ring_name = NULL;
+    char *replay_path = NULL;
+    replay_t replay;
+    char **ingest_paths = NULL;
+    int ingest_count = 0, ingest_parts = 1;
+    cpu_set_t timer_cpus, input_cpus;
+    int timer_pinned = 0, input_pinned = 0;
+    int priority = 0;
+    unsigned capacity = 0;
+    int policy = ALARM_LIMIT_REJECT;
+    char *end;
+    char *cpus;
+    static struct option options[] = {
+        {"slack", required_argument, NULL, 's'},
+        {"socket", required_argument, NULL, 'u'},
+        {"ring", required_argument, NULL, 'r'},
+        {"replay", required_argument, NULL, 'p'},
+        {"speed", required_argument, NULL, 'x'},
+        {"virtual", no_argument, NULL, 'v'},
+        {"ingest", required_argument, NULL, 'i'},
+        {"threads", required_argument, NULL, 't'},
+        {"affinity", required_argument, NULL, 'a'},
+        {"realtime", required_argument, NULL, 'R'},
+        {"max", required_argument, NULL, 'm'},
+        {NULL, 0, NULL, 0}
+    };
 
+    /*
+     * -s msec: slack window. An alarm may fire up to this long
+     * after its deadline, which lets the alarm thread batch
+     * deadlines that fall close together into one wakeup.
+     *
+     * -u path: also accept commands from clients of a Unix
+     * domain socket at this path.
+     *
+     * -r name: also accept requests from local processes through
+     * a shared-memory ring with this name (see alarm_ring.h).
+     *
+     * -p file: before reading the console, replay the command log
+     * in this file at the pace it was recorded (see replay_open
+     * and replay_run).
+     *
+     * -x factor: replay that many times faster; 0 replays as fast
+     * as the commands can be applied.
+     *
+     * -v: replay on a virtual clock, with no waiting at all, and
+     * exit when the log and the alarms it started are done.
+     *
+     * -i file: load the commands in this file before the replay
+     * and the console, on threads of their own (see ingest_files).
+     * May be given more than once.
+     *
+     * -t n: split each -i file into n pieces, one thread each.
+     *
+     * -a which=cpus: run the timer thread ("timer"), the threads
+     * that read commands ("input": the console, the socket and
+     * ring servers and -i loaders) or the display threads
+     * ("display") only on these CPUs, e.g. "input=0-3". May be
+     * given once for each. A virtual clock (-v) has no timer
+     * thread to pin.
+     *
+     * -R priority: real-time mode. Run the timer thread under
+     * SCHED_FIFO at this priority, with the process's memory
+     * locked and nothing allocated or written on the timer thread
+     * (see handoff_print).
+     *
+     * -m count[,policy]: allow at most this many alarms at once.
+     * A start beyond it is rejected ("reject", the default), waits
+     * for room ("block") or drops the alarm due last ("shed").
+     */
+    replay.speed = 1;
+    replay.virtual = 0;
+    while ((opt = getopt_long(argc, argv, "s:u:r:p:x:vi:t:a:R:m:", options, NULL)) != -1)
+    {
+        switch (opt)
+        {
+        case 's':
+            alarm_slack = atol(optarg);
+            if (alarm_slack < 0)
+                alarm_slack = 0;
+            break;
+        case 'u':
+            socket_path = optarg;
+            break;
+        case 'r':
+            ring_name = optarg;
+            break;
+        case 'p':
+            replay_path = optarg;
+            break;
+        case 'x':
+            replay.speed = atof(optarg);
+            if (replay.speed < 0)
+                replay.speed = 0;
+            break;
+        case 'v':
+            replay.virtual = 1;
+            break;
+        case 'i':
+            ingest_paths = (char **)realloc(ingest_paths,
+                (ingest_count + 1) * sizeof(char *));
+            if (ingest_paths == NULL)
+                errno_abort("Allocate ingest list");
+            ingest_paths[ingest_count++] = optarg;
+            break;
+        case 't':
+            ingest_parts = atoi(optarg);
+            if (ingest_parts < 1)
+                ingest_parts = 1;
+            break;
+        case 'a':
+            cpus = strchr(optarg, '=');
+            if (cpus != NULL && strncmp(optarg, "timer=", 6) == 0
+                && cpu_parse(cpus + 1, &timer_cpus) == 0)
+                timer_pinned = 1;
+            else if (cpus != NULL && strncmp(optarg, "input=", 6) == 0
+                && cpu_parse(cpus + 1, &input_cpus) == 0)
+                input_pinned = 1;
+            else if (cpus != NULL && strncmp(optarg, "display=", 8) == 0
+                && cpu_parse(cpus + 1, &display_cpus) == 0)
+                display_pinned = 1;
+            else
+            {
+                fprintf(stderr, "Bad affinity \"%s\": use timer=, input= or display= and a CPU list\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'R':
+            priority = atoi(optarg);
+            if (priority < sched_get_priority_min(SCHED_FIFO)
+                || priority > sched_get_priority_max(SCHED_FIFO))
+            {
+                fprintf(stderr, "Bad priority \"%s\": use %d to %d\n", optarg,
+                        sched_get_priority_min(SCHED_FIFO),
+                        sched_get_priority_max(SCHED_FIFO));
+                exit(1);
+            }
+            break;
+        case 'm':
+            capacity = strtoul(optarg, &end, 10);
+            if (*end == ',' && strcmp(end + 1, "reject") == 0)
+                policy = ALARM_LIMIT_REJECT;
+            else if (*end == ',' && strcmp(end + 1, "block") == 0)
+                policy = ALARM_LIMIT_BLOCK;
+            else if (*end == ',' && strcmp(end + 1, "shed") == 0)
+                policy = ALARM_LIMIT_SHED;
+            else if (*end != '\0' || end == optarg)
+            {
+                fprintf(stderr, "Bad limit \"%s\": use count[,reject|block|shed]\n", optarg);
+                exit(1);
+            }
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-s slack_msec] [-u socket_path] [-r ring_name] [-i ingest_file]... [-t threads] [-a which=cpus]... [-R priority] [-m max[,policy]] [-p replay_log [-x speed | -v]]\n", argv[0]);
+            exit(1);
+        }
+    }
 
-    if (sem_init(&main_sem,0,1)<0){
-        printf("Error creating sempahore");
+    if (replay.virtual && replay_path == NULL)
+    {
+        fprintf(stderr, "-v needs a log to replay (-p)\n");
         exit(1);
     }
-        if (sem_init(&display_sem,0,1)<0){
-        printf("Error creating sempahore");
+    if (replay.virtual && priority > 0)
+    {
+        fprintf(stderr, "-R needs the real clock, not -v\n");
         exit(1);
     }
-
-    status = pthread_create(
-        &thread, NULL, alarm_thread, NULL);
-    if (status != 0)
-        err_abort(status, "Create alarm thread");
-
-    while (1)
+    if (replay.virtual && timer_pinned)
     {
-        printf("Alarm> ");
-        if (fgets(line, sizeof(line), stdin) == NULL)
-            exit(0);
-        if (strlen(line) <= 1)
-            continue;
-        alarm = (alarm_t *)malloc(sizeof(alarm_t));
-        if (alarm == NULL)
-            errno_abort("Allocate alarm");
+        fprintf(stderr, "-a timer= needs the real clock, not -v\n");
+        exit(1);
+    }
 
-        if ((sscanf(line, "start(%d): group(%d) %d %128[^\n]", &alarm->alarm_id, &alarm->group_id, &alarm->seconds, alarm->message) < 4)
-        && (sscanf(line, "change(%d): group(%d) %d %128[^\n]", &alarm->alarm_id, &alarm->group_id, &alarm->seconds, alarm->message) < 4))
-        {
-            fprintf(stderr, "Bad command\n");
-            free(alarm);
-        }
-        else if (!(sscanf(line, "start(%d): group(%d) %d %128[^\n]", &alarm->alarm_id, &alarm->group_id, &alarm->seconds, alarm->message) < 4))
-        //else if (!(sscanf(line, "Start_Alarm(%d): Group(%d) %d %128[^\n]",&alarm->alarm_id, &alarm->group_id, &alarm->seconds, alarm->message)<4))
-        {
-            status = sem_wait(&main_sem);
-            if (status!=0)
-                err_abort(status,"Lock mutex");
+    /*
+     * Pin this thread first: every input thread is started from it
+     * and inherits its CPUs, and the scheduler's memory, first
+     * touched here, is placed on their node.
+     */
+    if (input_pinned)
+    {
+        status = pthread_setaffinity_np(
+            pthread_self(), sizeof(input_cpus), &input_cpus);
+        if (status != 0)
+            err_abort(status, "Pin input threads");
+    }
 
-            alarm->changed = UNCHANGED;
+    scan_init(NULL);
+    if (replay_path != NULL)
+        replay_open(&replay, replay_path);
+    if (replay.virtual)
+        scheduler = alarm_sched_create_clock(alarm_print, &delivery,
+            alarm_slack, ALARM_CLOCK_VIRTUAL, replay_start(&replay));
+    else if (priority > 0)
+        scheduler = handoff_start(alarm_slack, priority);
+    else
+        scheduler = alarm_sched_create(display_print, NULL, alarm_slack);
+    if (scheduler == NULL)
+        errno_abort("Create scheduler");
+    alarm_sched_limit(scheduler, capacity, policy);
+    if (timer_pinned)
+    {
+        status = alarm_sched_affinity(
+            scheduler, sizeof(timer_cpus), &timer_cpus);
+        if (status != 0)
+            err_abort(status, "Pin timer thread");
+    }
 
-            /*
-               * Insert the new alarm into the list of alarms,
-               * sorted by alarm id.
-               */
-            //A3.2.1
-            //Prints out the required message and a new line is prompted
-            alarm_insert(alarm);
-            fprintf(stdout, "Alarm(%d) Inserted by Main Thread %d Into Alarm List at %d: Group(%d) %d %s\n", alarm->alarm_id, pthread_self(), alarm->seconds, alarm->group_id, alarm->time, alarm->message);
-            //
+    if (socket_path != NULL)
+    {
+        listener = server_listen(socket_path);
+        status = pthread_create(
+            &thread, NULL, server_thread, &listener);
+        if (status != 0)
+            err_abort(status, "Create server thread");
+    }
 
-            status = sem_post(&main_sem);
-            if (status!=0)
-                err_abort(status,"Unlock mutex");
-        }
-        else if (!(sscanf(line, "change(%d): group(%d) %d %128[^\n]", &alarm->alarm_id, &alarm->group_id, &alarm->seconds, alarm->message) < 4))
-        //else if(!(sscanf(line, "Change_Alarm(%d): Group(%d) %d %128[^\n]",&alarm->alarm_id, &alarm->group_id, alarm->seconds, alarm->message)<4))
-        {
-            //Change alarm
-            status = sem_wait(&main_sem);
-            if (status!=0)
-                err_abort(status,"Lock mutex");
+    if (ring_name != NULL)
+    {
+        status = pthread_create(
+            &thread, NULL, ring_thread, ring_create(ring_name));
+        if (status != 0)
+            err_abort(status, "Create ring thread");
+    }
 
-            alarm->time = time(NULL) + alarm->seconds;
+    if (ingest_count > 0)
+        ingest_files(ingest_paths, ingest_count, ingest_parts);
 
-            //Change alarm settings to new alarm
-            change_alarm(alarm);
+    if (replay_path != NULL)
+        replay_run(&replay);
+    if (replay.virtual)
+        exit(0);
 
-            status = sem_post(&main_sem);
-            if (status!=0)
-                err_abort(status,"Unlock mutex");
-        }
-    }
+    console_loop();
 }
@@ -395,14 +395,14 @@ int main (int argc, char *argv[])
             errno_abort ("Allocate alarm");
 
     //parse input into two alarm request. "Start_Alarm" and "Change_Alarm"
-      if ((sscanf(line, "start(%d): group(%d) %d %128[^\n]",&alarm->alarm_id, &alarm->group_id, &alarm->seconds, alarm->message)<4)
-          && (sscanf(line, "change(%d): group(%d) %d %128[^\n]",&alarm->alarm_id, &alarm->group_id, &alarm->seconds, alarm->message)<4))
+      if ((sscanf(line, "start(%d): group(%d) %d %127[^\n]",&alarm->alarm_id, &alarm->group_id, &alarm->seconds, alarm->message)<4)
+          && (sscanf(line, "change(%d): group(%d) %d %127[^\n]",&alarm->alarm_id, &alarm->group_id, &alarm->seconds, alarm->message)<4))
           {
             fprintf (stderr, "Bad command\n");
             free (alarm);
           }
 
-      else if (!(sscanf(line, "start(%d): group(%d) %d %128[^\n]",&alarm->alarm_id, &alarm->group_id, &alarm->seconds, alarm->message)<4))
+      else if (!(sscanf(line, "start(%d): group(%d) %d %127[^\n]",&alarm->alarm_id, &alarm->group_id, &alarm->seconds, alarm->message)<4))
          {
             now = time(NULL);
             alarm->link = NULL;
@@ -421,7 +421,7 @@ int main (int argc, char *argv[])
             err_abort (status, "Unlock mutex");
           }
 
-        else if (!(sscanf(line, "change(%d): group(%d) %d %128[^\n]",&alarm->alarm_id, &alarm->group_id, &alarm->seconds, alarm->message)<4))
+        else if (!(sscanf(line, "change(%d): group(%d) %d %127[^\n]",&alarm->alarm_id, &alarm->group_id, &alarm->seconds, alarm->message)<4))
              {
                   now = time(NULL);
 
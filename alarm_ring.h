@@ -0,0 +1,129 @@
+#ifndef __alarm_ring_h
+#define __alarm_ring_h
+
+/*
+ * Shared-memory submission ring.
+ *
+ * The alarm program, started with -r name, creates a POSIX shared
+ * memory object "name" holding one alarm_ring_t. Any process on
+ * the same host can map it with alarm_ring_attach and submit
+ * alarm requests with alarm_ring_submit, which costs a
+ * compare-and-swap and a copy of the request -- no system call
+ * unless the alarm program's consumer thread is asleep, in which
+ * case the submitter rings a futex doorbell to wake it.
+ *
+ * The ring is a bounded multi-producer, single-consumer queue in
+ * the style of Dmitry Vyukov's: every slot carries a sequence
+ * number that says whose turn it is. A producer claims position
+ * "pos" by advancing tail, fills the slot and publishes it by
+ * setting its sequence to pos + 1; the consumer releases it back
+ * to producers by setting it to pos + ALARM_RING_SLOTS.
+ *
+ * Link producers with -lrt on systems where shm_open needs it.
+ */
+#include <stdatomic.h>
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include "alarm_sched.h"
+
+#define ALARM_RING_MAGIC    0x616c726dU   /* "alrm" */
+#define ALARM_RING_SLOTS    4096          /* power of two */
+
+/*
+ * Requests are the library's alarm_request_t, with ALARM_OP_*
+ * opcodes mirroring the console commands.
+ */
+typedef struct alarm_ring_slot_tag
+{
+    _Alignas(64) atomic_ulong seq;
+    alarm_request_t request;
+} alarm_ring_slot_t;
+
+typedef struct alarm_ring_tag
+{
+    unsigned magic;
+    unsigned slots;
+    _Alignas(64) atomic_ulong tail;     /* next position producers claim */
+    _Alignas(64) atomic_ulong head;     /* next position the consumer reads */
+    atomic_uint sleeping;               /* consumer is (about to be) waiting */
+    atomic_uint doorbell;               /* futex word producers ring */
+    alarm_ring_slot_t slot[ALARM_RING_SLOTS];
+} alarm_ring_t;
+
+/*
+ * Map the ring created by the alarm program. Returns NULL, with
+ * errno set, if it does not exist or is not an alarm ring.
+ */
+static inline alarm_ring_t *alarm_ring_attach(const char *name)
+{
+    alarm_ring_t *ring;
+    int fd;
+
+    fd = shm_open(name, O_RDWR, 0);
+    if (fd < 0)
+        return NULL;
+    ring = (alarm_ring_t *)mmap(NULL, sizeof(alarm_ring_t),
+        PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (ring == MAP_FAILED)
+        return NULL;
+    if (ring->magic != ALARM_RING_MAGIC || ring->slots != ALARM_RING_SLOTS)
+    {
+        munmap(ring, sizeof(alarm_ring_t));
+        errno = EINVAL;
+        return NULL;
+    }
+    return ring;
+}
+
+/*
+ * Queue one request. Returns 0, or -1 if the ring is full; the
+ * caller decides whether to retry or drop.
+ */
+static inline int alarm_ring_submit(alarm_ring_t *ring,
+                                    const alarm_request_t *request)
+{
+    alarm_ring_slot_t *slot;
+    unsigned long pos, seq;
+    long diff;
+
+    pos = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    while (1)
+    {
+        slot = &ring->slot[pos & (ALARM_RING_SLOTS - 1)];
+        seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        diff = (long)(seq - pos);
+        if (diff == 0)
+        {
+            if (atomic_compare_exchange_weak_explicit(&ring->tail, &pos,
+                    pos + 1, memory_order_relaxed, memory_order_relaxed))
+                break;
+        }
+        else if (diff < 0)
+            return -1;
+        else
+            pos = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    }
+    memcpy(&slot->request, request, sizeof(*request));
+    atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+
+    /*
+     * Pairs with the consumer setting "sleeping" before its last
+     * look at the ring: either it sees this slot, or we see it
+     * asleep and ring the doorbell.
+     */
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&ring->sleeping, memory_order_relaxed))
+    {
+        atomic_fetch_add(&ring->doorbell, 1);
+        syscall(SYS_futex, &ring->doorbell, FUTEX_WAKE, 1, NULL, NULL, 0);
+    }
+    return 0;
+}
+
+#endif
@@ -0,0 +1,279 @@
+/*
+ * alarm_rt_bench.c
+ *
+ * Firing jitter of the scheduler in alarm_sched.c, in its normal
+ * mode and in real-time mode (alarm_sched_create_realtime, with
+ * memory locked), under load. Periodic alarms fire every second
+ * for a number of seconds while other threads compete for the
+ * CPU, churn the allocator and start and cancel alarms of their
+ * own; the callback records how late each firing came, in
+ * microseconds. Deadlines fall on whole seconds, so every alarm
+ * fires in one batch a second, and the last of a batch is late by
+ * the time the batch takes as well.
+ *
+ * "timer mallocs" is counted here, not by the scheduler: malloc,
+ * calloc and realloc are replaced with versions that count calls
+ * made on the timer thread, including any from inside the C
+ * library, such as a qsort's buffer. The timer thread is marked by
+ * its first callback, for a warm-up alarm fired before the others
+ * are set.
+ *
+ * Real-time mode needs the right to use SCHED_FIFO (root, or
+ * CAP_SYS_NICE) and to lock memory; without it only the normal
+ * run is made. The difference shows most with fewer CPUs than
+ * load threads.
+ *
+ * Build with "make -f make bench" and run
+ * "./alarm_rt_bench [alarms] [seconds] [load threads]".
+ */
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <stdatomic.h>
+#include "alarm_sched.h"
+
+#define WARMUP_ID INT_MIN
+
+/*
+ * glibc's own entry points, which the replacements below call.
+ */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t count, size_t size);
+extern void *__libc_realloc(void *block, size_t size);
+
+static __thread int on_timer;       /* this is the timer thread */
+static atomic_ulong timer_mallocs;
+
+void *malloc(size_t size)
+{
+    if (on_timer)
+        atomic_fetch_add(&timer_mallocs, 1);
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size)
+{
+    if (on_timer)
+        atomic_fetch_add(&timer_mallocs, 1);
+    return __libc_calloc(count, size);
+}
+
+void *realloc(void *block, size_t size)
+{
+    if (on_timer)
+        atomic_fetch_add(&timer_mallocs, 1);
+    return __libc_realloc(block, size);
+}
+
+typedef struct bench_tag
+{
+    long *late;             /* usec late, one per firing */
+    int late_count, late_size;
+    atomic_int stop;
+    atomic_int warm;        /* the warm-up alarm has fired */
+} bench_t;
+
+static long long now_usec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+ * Runs on the timer thread: no allocation, no I/O.
+ */
+static void bench_fired(const alarm_event_t *event, void *arg)
+{
+    bench_t *bench = (bench_t *)arg;
+    long long now;
+
+    if (event->type != ALARM_EVENT_FIRED)
+        return;
+    if (event->alarm_id == WARMUP_ID)
+    {
+        on_timer = 1;
+        atomic_store(&bench->warm, 1);
+        return;
+    }
+    if (event->alarm_id < 0)
+        return;
+    now = now_usec();
+    if (bench->late_count < bench->late_size)
+        bench->late[bench->late_count++] = (long)(now - (long long)event->time * 1000000);
+}
+
+/*
+ * Load: spin, allocate and free, and start and cancel one-shot
+ * alarms far in the future, with negative ids the callback
+ * ignores.
+ */
+typedef struct load_tag
+{
+    bench_t *bench;
+    alarm_sched_t *sched;
+    int id;
+} load_t;
+
+static void *load_thread(void *arg)
+{
+    load_t *load = (load_t *)arg;
+    void *block[64];
+    unsigned seed = load->id + 1;
+    int i, n, id;
+
+    for (n = 0; !atomic_load(&load->bench->stop); n++)
+    {
+        for (i = 0; i < 64; i++)
+        {
+            seed = seed * 1103515245 + 12345;
+            block[i] = malloc(16 + seed % 4096);
+            if (block[i] != NULL)
+                memset(block[i], i, 16);
+        }
+        for (i = 0; i < 64; i++)
+            free(block[i]);
+        id = -1 - (load->id * 1000 + n % 1000);
+        alarm_sched_start(load->sched, id, 99, 3600, 0, -1, "load", NULL);
+        alarm_sched_cancel(load->sched, id, NULL);
+    }
+    return NULL;
+}
+
+static int compare_long(const void *a, const void *b)
+{
+    long x = *(const long *)a, y = *(const long *)b;
+
+    return (x > y) - (x < y);
+}
+
+/*
+ * Run one mode and print its line; returns 0, or the error that
+ * kept the scheduler from starting.
+ */
+static int bench_run(const char *name, const alarm_realtime_t *realtime,
+                     int alarms, int seconds, int loads)
+{
+    bench_t bench;
+    alarm_sched_t *sched;
+    alarm_stats_t stats;
+    pthread_t *threads;
+    load_t *load;
+    unsigned long mallocs;
+    long sum;
+    int i, n;
+
+    memset(&bench, 0, sizeof(bench));
+    bench.late_size = alarms * (seconds + 2);
+    bench.late = calloc(bench.late_size, sizeof(long));
+    threads = calloc(loads, sizeof(pthread_t));
+    load = calloc(loads, sizeof(load_t));
+    if (bench.late == NULL || threads == NULL || load == NULL)
+    {
+        perror("calloc");
+        exit(1);
+    }
+    atomic_init(&bench.stop, 0);
+    atomic_init(&bench.warm, 0);
+
+    if (realtime != NULL)
+    {
+        if (mlockall(MCL_CURRENT | MCL_FUTURE) == -1)
+            return errno;
+        sched = alarm_sched_create_realtime(bench_fired, &bench, 0, realtime);
+    }
+    else
+        sched = alarm_sched_create(bench_fired, &bench, 0);
+    if (sched == NULL)
+    {
+        n = errno;
+        munlockall();
+        return n;
+    }
+
+    /*
+     * Due at once; wait for it, so that the timer thread is marked
+     * and its count starts at zero before anything is measured.
+     */
+    alarm_sched_start(sched, WARMUP_ID, 0, 0, 0, 0, "warm-up", NULL);
+    while (!atomic_load(&bench.warm))
+        usleep(1000);
+    atomic_store(&timer_mallocs, 0);
+
+    for (i = 0; i < loads; i++)
+    {
+        load[i].bench = &bench;
+        load[i].sched = sched;
+        load[i].id = i;
+        if (pthread_create(&threads[i], NULL, load_thread, &load[i]) != 0)
+        {
+            perror("pthread_create");
+            exit(1);
+        }
+    }
+
+    for (i = 0; i < alarms; i++)
+        alarm_sched_start(sched, i, i % 8, 1, 1, 0, "tick", NULL);
+    sleep(seconds);
+
+    atomic_store(&bench.stop, 1);
+    for (i = 0; i < loads; i++)
+        pthread_join(threads[i], NULL);
+    alarm_sched_stats(sched, &stats);
+    mallocs = atomic_load(&timer_mallocs);
+    alarm_sched_destroy(sched);
+    if (realtime != NULL)
+        munlockall();
+
+    n = bench.late_count;
+    qsort(bench.late, n, sizeof(long), compare_long);
+    for (sum = 0, i = 0; i < n; i++)
+        sum += bench.late[i];
+    if (n == 0)
+        printf("%-9s no firings\n", name);
+    else
+        printf("%-9s %6d firings  late usec: mean %6ld  p50 %6ld  p99 %6ld  p99.9 %6ld  max %6ld  timer mallocs %lu (scheduler counted %lu)\n",
+               name, n, sum / n, bench.late[n / 2], bench.late[n * 99 / 100],
+               bench.late[n * 999 / 1000], bench.late[n - 1],
+               mallocs, stats.timer_allocs);
+    free(bench.late);
+    free(threads);
+    free(load);
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    alarm_realtime_t realtime;
+    int alarms, seconds, loads, status;
+
+    alarms = argc > 1 ? atoi(argv[1]) : 500;
+    seconds = argc > 2 ? atoi(argv[2]) : 5;
+    loads = argc > 3 ? atoi(argv[3]) : 4;
+    if (alarms < 1 || seconds < 1 || loads < 0)
+    {
+        fprintf(stderr, "Usage: %s [alarms] [seconds] [load threads]\n", argv[0]);
+        return 1;
+    }
+    printf("%d periodic alarms, %d seconds, %d load threads\n",
+           alarms, seconds, loads);
+
+    status = bench_run("normal", NULL, alarms, seconds, loads);
+    if (status != 0)
+        printf("normal: %s\n", strerror(status));
+
+    realtime.priority = 50;
+    realtime.reserve = alarms * 2;
+    status = bench_run("realtime", &realtime, alarms, seconds, loads);
+    if (status != 0)
+        printf("realtime: %s (needs SCHED_FIFO and mlockall)\n", strerror(status));
+    return 0;
+}
@@ -0,0 +1,478 @@
+/*
+ * alarm_scan.c
+ *
+ * Newline scanning and command parsing for New_Alarm_Cond.c; see
+ * alarm_scan.h.
+ */
+#include <string.h>
+#include <ctype.h>
+#include "alarm_scan.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SCAN_X86 1
+#endif
+
+#define ONES  0x0101010101010101ULL
+#define HIGHS 0x8080808080808080ULL
+
+/*
+ * Bit i of the result is set if byte i of "word" (in memory
+ * order) is a newline. Exact, unlike the usual has-zero test,
+ * so it can feed a bitmap directly.
+ */
+static unsigned newline_byte_mask(uint64_t word)
+{
+    uint64_t t, m;
+
+    t = word ^ (ONES * '\n');
+    m = ~(((t & ~HIGHS) + ~HIGHS) | t) & HIGHS;
+    return (unsigned)(((m >> 7) * 0x0102040810204080ULL) >> 56);
+}
+
+static uint64_t load64(const char *p)
+{
+    uint64_t word;
+
+    memcpy(&word, p, sizeof(word));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    word = __builtin_bswap64(word);
+#endif
+    return word;
+}
+
+/*
+ * Bits for the last partial 64-byte group, one byte at a time.
+ */
+static uint64_t scan_tail(const char *p, size_t len)
+{
+    uint64_t bits = 0;
+    size_t i;
+
+    for (i = 0; i < len; i++)
+        if (p[i] == '\n')
+            bits |= 1ULL << i;
+    return bits;
+}
+
+static void scan_scalar(const char *block, size_t len, uint64_t *bits)
+{
+    size_t i;
+    uint64_t word;
+    int j;
+
+    for (i = 0; i + 64 <= len; i += 64)
+    {
+        word = 0;
+        for (j = 0; j < 8; j++)
+            word |= (uint64_t)newline_byte_mask(load64(block + i + 8 * j)) << (8 * j);
+        *bits++ = word;
+    }
+    if (i < len)
+        *bits = scan_tail(block + i, len - i);
+}
+
+#ifdef SCAN_X86
+__attribute__((target("sse2")))
+static void scan_sse2(const char *block, size_t len, uint64_t *bits)
+{
+    const __m128i nl = _mm_set1_epi8('\n');
+    uint64_t a, b, c, d;
+    size_t i;
+
+    for (i = 0; i + 64 <= len; i += 64)
+    {
+        a = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(nl,
+                _mm_loadu_si128((const __m128i *)(block + i))));
+        b = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(nl,
+                _mm_loadu_si128((const __m128i *)(block + i + 16))));
+        c = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(nl,
+                _mm_loadu_si128((const __m128i *)(block + i + 32))));
+        d = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(nl,
+                _mm_loadu_si128((const __m128i *)(block + i + 48))));
+        *bits++ = a | b << 16 | c << 32 | d << 48;
+    }
+    if (i < len)
+        *bits = scan_tail(block + i, len - i);
+}
+
+__attribute__((target("avx2")))
+static void scan_avx2(const char *block, size_t len, uint64_t *bits)
+{
+    const __m256i nl = _mm256_set1_epi8('\n');
+    uint64_t lo, hi;
+    size_t i;
+
+    for (i = 0; i + 64 <= len; i += 64)
+    {
+        lo = (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(nl,
+                _mm256_loadu_si256((const __m256i *)(block + i))));
+        hi = (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(nl,
+                _mm256_loadu_si256((const __m256i *)(block + i + 32))));
+        *bits++ = lo | hi << 32;
+    }
+    if (i < len)
+        *bits = scan_tail(block + i, len - i);
+}
+#endif
+
+void (*scan_newlines)(const char *block, size_t len, uint64_t *bits) = scan_scalar;
+
+const char *scan_init(const char *force)
+{
+#ifdef SCAN_X86
+    __builtin_cpu_init();
+    if (force == NULL ? __builtin_cpu_supports("avx2") : strcmp(force, "avx2") == 0)
+    {
+        scan_newlines = scan_avx2;
+        return "avx2";
+    }
+    if (force == NULL ? __builtin_cpu_supports("sse2") : strcmp(force, "sse2") == 0)
+    {
+        scan_newlines = scan_sse2;
+        return "sse2";
+    }
+#endif
+    scan_newlines = scan_scalar;
+    return "scalar";
+}
+
+/*
+ * Command prefixes, padded to 16 bytes for a single SSE2 compare.
+ * "mask" has a bit set for each byte of the prefix proper.
+ */
+typedef struct prefix_tag
+{
+    char text[16];
+    unsigned mask;
+    size_t len;
+    int op;
+} prefix_t;
+
+#define PREFIX(s, op) { s, (1u << (sizeof(s) - 1)) - 1, sizeof(s) - 1, op }
+
+static const prefix_t prefixes[] = {
+    PREFIX("start(", COMMAND_START),
+    PREFIX("change(", COMMAND_CHANGE),
+    PREFIX("cancel(", COMMAND_CANCEL),
+    PREFIX("periodic(", COMMAND_PERIODIC),
+    PREFIX("slack:", COMMAND_SLACK),
+    PREFIX("stats", COMMAND_STATS),
+    PREFIX("list(", COMMAND_LIST),
+    PREFIX("query(", COMMAND_QUERY),
+    PREFIX("change_group(", COMMAND_BULK),
+};
+
+#define PREFIXES (int)(sizeof(prefixes) / sizeof(prefixes[0]))
+
+/*
+ * Which command "line" starts with; *skip is set to the prefix
+ * length.
+ */
+static int match_prefix(const char *line, size_t len, size_t *skip)
+{
+    int i;
+#ifdef SCAN_X86
+    __m128i text;
+    unsigned eq;
+
+    if (len >= 16)
+    {
+        text = _mm_loadu_si128((const __m128i *)line);
+        for (i = 0; i < PREFIXES; i++)
+        {
+            eq = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(text,
+                    _mm_loadu_si128((const __m128i *)prefixes[i].text)));
+            if ((eq & prefixes[i].mask) == prefixes[i].mask)
+            {
+                *skip = prefixes[i].len;
+                return prefixes[i].op;
+            }
+        }
+        return COMMAND_BAD;
+    }
+#endif
+    for (i = 0; i < PREFIXES; i++)
+    {
+        if (len >= prefixes[i].len
+            && memcmp(line, prefixes[i].text, prefixes[i].len) == 0)
+        {
+            *skip = prefixes[i].len;
+            return prefixes[i].op;
+        }
+    }
+    return COMMAND_BAD;
+}
+
+/*
+ * The rest of the parser works on a cursor over [p, end) and
+ * follows sscanf: a space in a format matches any amount of white
+ * space, including none, and %d skips white space and takes an
+ * optional sign.
+ */
+typedef struct cursor_tag
+{
+    char *p, *end;
+} cursor_t;
+
+static void skip_space(cursor_t *c)
+{
+    while (c->p < c->end && isspace((unsigned char)*c->p))
+        c->p++;
+}
+
+static int literal(cursor_t *c, const char *text)
+{
+    for (; *text != '\0'; text++)
+    {
+        if (*text == ' ')
+            skip_space(c);
+        else if (c->p < c->end && *c->p == *text)
+            c->p++;
+        else
+            return 0;
+    }
+    return 1;
+}
+
+/*
+ * Number of leading decimal digits in the eight bytes of "word".
+ */
+static int digit_count(uint64_t word)
+{
+    uint64_t bad;
+
+    /*
+     * A byte is a digit if its high nibble is 3 and adding 6 to
+     * it does not carry out of the low nibble.
+     */
+    bad = ((word & (ONES * 0xf0)) ^ (ONES * 0x30))
+        | (((word + ONES * 0x06) & (ONES * 0xf0)) ^ (ONES * 0x30));
+    return bad == 0 ? 8 : __builtin_ctzll(bad) / 8;
+}
+
+/*
+ * Value of the first "count" (1 to 8) digits of "word": shift them
+ * to the top, then combine pairs, quads and halves with three
+ * multiplies.
+ */
+static uint64_t digit_value(uint64_t word, int count)
+{
+    word = (word & (ONES * 0x0f)) << (8 * (8 - count));
+    word = (word * 10 + (word >> 8)) & 0x00ff00ff00ff00ffULL;
+    word = (word * 100 + (word >> 16)) & 0x0000ffff0000ffffULL;
+    word = (word * 10000 + (word >> 32)) & 0xffffffffULL;
+    return word;
+}
+
+static const unsigned long power10[9] = {
+    1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000
+};
+
+static int number(cursor_t *c, long *value)
+{
+    unsigned long result;
+    uint64_t word;
+    int negative, count, digits;
+
+    skip_space(c);
+    negative = 0;
+    if (c->p < c->end && (*c->p == '-' || *c->p == '+'))
+        negative = *c->p++ == '-';
+    result = 0;
+    digits = 0;
+    while (c->end - c->p >= 8)
+    {
+        word = load64(c->p);
+        count = digit_count(word);
+        if (count == 0)
+            break;
+        result = result * power10[count] + digit_value(word, count);
+        c->p += count;
+        digits += count;
+        if (count < 8)
+            break;
+    }
+    while (c->p < c->end && *c->p >= '0' && *c->p <= '9')
+    {
+        result = result * 10 + (*c->p++ - '0');
+        digits++;
+    }
+    if (digits == 0)
+        return 0;
+    *value = negative ? -(long)result : (long)result;
+    return 1;
+}
+
+static int integer(cursor_t *c, int *value)
+{
+    long result;
+
+    if (!number(c, &result))
+        return 0;
+    *value = (int)result;
+    return 1;
+}
+
+/*
+ * A group id, or "*" for any group, as -1.
+ */
+static int group(cursor_t *c, int *value)
+{
+    skip_space(c);
+    if (c->p < c->end && *c->p == '*')
+    {
+        c->p++;
+        *value = -1;
+        return 1;
+    }
+    return integer(c, value);
+}
+
+/*
+ * An option before a message, such as "slack(300)": "name" and a
+ * number, then ")". The cursor moves past it only if it is all
+ * there.
+ */
+static int option(cursor_t *c, const char *name, long *value)
+{
+    cursor_t m = *c;
+    long result;
+
+    if (!literal(&m, name) || !number(&m, &result) || !literal(&m, ")"))
+        return 0;
+    skip_space(&m);
+    *c = m;
+    *value = result;
+    return 1;
+}
+
+/*
+ * The message: everything left on the line after white space, up
+ * to the newline. Returns 0 if it is empty.
+ */
+static int message(cursor_t *c, command_t *command)
+{
+    char *end;
+
+    skip_space(c);
+    end = memchr(c->p, '\n', c->end - c->p);
+    if (end == NULL)
+        end = c->end;
+    if (end == c->p)
+        return 0;
+    command->message = c->p;
+    command->length = end - c->p;
+    return 1;
+}
+
+int command_parse(char *line, size_t len, command_t *command)
+{
+    cursor_t c, m;
+    size_t skip;
+    long priority;
+    int op;
+
+    command->slack = -1;
+    command->priority = 0;
+    command->message = NULL;
+    command->length = 0;
+    op = match_prefix(line, len, &skip);
+    c.p = line + skip;
+    c.end = line + len;
+
+    switch (op)
+    {
+    case COMMAND_STATS:
+        break;
+    case COMMAND_CANCEL:
+        if (!integer(&c, &command->alarm_id))
+            op = COMMAND_BAD;
+        break;
+    case COMMAND_LIST:
+        if (!integer(&c, &command->alarm_id) || !literal(&c, " -")
+            || !integer(&c, &command->last) || !literal(&c, ")"))
+            op = COMMAND_BAD;
+        break;
+    case COMMAND_QUERY:
+        /*
+         * "query(seconds)" or "query(from-to)", then optionally
+         * ": group(id)".
+         */
+        command->to = -1;
+        command->group_id = -1;
+        if (!number(&c, &command->from) || command->from < 0
+            || (literal(&c, " -") && (!number(&c, &command->to) || command->to < 0))
+            || !literal(&c, ")"))
+        {
+            op = COMMAND_BAD;
+            break;
+        }
+        if (literal(&c, " :") && (!literal(&c, " group(")
+            || !integer(&c, &command->group_id) || !literal(&c, ")")))
+            op = COMMAND_BAD;
+        break;
+    case COMMAND_BULK:
+        /*
+         * "change_group(first-last): group(from) group(to)", then
+         * optionally the seconds to fire in.
+         */
+        command->seconds = -1;
+        if (!integer(&c, &command->alarm_id) || !literal(&c, " -")
+            || !integer(&c, &command->last) || !literal(&c, "): group(")
+            || !group(&c, &command->group_id) || !literal(&c, ") group(")
+            || !group(&c, &command->new_group) || !literal(&c, ")"))
+        {
+            op = COMMAND_BAD;
+            break;
+        }
+        skip_space(&c);
+        if (c.p < c.end && (!integer(&c, &command->seconds) || command->seconds < 0))
+            op = COMMAND_BAD;
+        break;
+    case COMMAND_SLACK:
+        if (!literal(&c, " group(") || !integer(&c, &command->group_id)
+            || !literal(&c, ")") || !number(&c, &command->slack))
+            op = COMMAND_BAD;
+        break;
+    case COMMAND_START:
+    case COMMAND_PERIODIC:
+    case COMMAND_CHANGE:
+        if (!integer(&c, &command->alarm_id) || !literal(&c, "): group(")
+            || !integer(&c, &command->group_id) || !literal(&c, ")")
+            || !integer(&c, &command->seconds))
+        {
+            op = COMMAND_BAD;
+            break;
+        }
+        if (op == COMMAND_PERIODIC && command->seconds <= 0)
+        {
+            op = COMMAND_BAD;
+            break;
+        }
+        skip_space(&c);
+        if (op != COMMAND_CHANGE)
+        {
+            /*
+             * "slack(msec)", for start only, then "priority(level)",
+             * each optional, before the message. One that is not
+             * well formed, or leaves no message, is just the start
+             * of the message.
+             */
+            m = c;
+            if (op == COMMAND_START)
+                option(&m, "slack(", &command->slack);
+            if (option(&m, "priority(", &priority))
+                command->priority = (int)priority;
+            if (message(&m, command))
+                break;
+            command->slack = -1;
+            command->priority = 0;
+        }
+        if (!message(&c, command))
+            op = COMMAND_BAD;
+        break;
+    }
+    command->op = op;
+    return op;
+}
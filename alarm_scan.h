@@ -0,0 +1,84 @@
+#ifndef __alarm_scan_h
+#define __alarm_scan_h
+
+/*
+ * alarm_scan.h
+ *
+ * Fast scanning and parsing of command input, for batch loads and
+ * replayed command logs, where splitting lines and sscanf used to
+ * be most of the cost.
+ *
+ * scan_newlines marks every newline in a block in a bitmap, 32 or
+ * 16 bytes per step with AVX2 or SSE2, or 8 with plain 64-bit
+ * words; scan_init picks the widest the CPU supports. The caller
+ * then walks the set bits, so short lines cost no call per line.
+ *
+ * command_parse recognises one command line, matching the command
+ * prefix with one 16-byte compare and parsing integers eight
+ * digits at a time. The lines it accepts are
+ *
+ *      start(id): group(g) seconds [slack(msec)] [priority(p)] message
+ *      periodic(id): group(g) seconds [priority(p)] message
+ *      change(id): group(g) seconds message
+ *      cancel(id
+ *      slack: group(g) msec
+ *      list(first-last)
+ *      query(seconds) or query(from-to), then optionally ": group(g)"
+ *      change_group(first-last): group(g) group(g) [seconds]
+ *      stats
+ *
+ * where a group in change_group may be "*", and white space may
+ * come between any two tokens, as with sscanf. Nothing after
+ * "cancel(id" or "stats" is looked at. A slack or priority that
+ * is not well formed, or leaves no message after it, is taken as
+ * the start of the message; periodic needs seconds above 0.
+ */
+#include <stddef.h>
+#include <stdint.h>
+
+extern void (*scan_newlines)(const char *block, size_t len, uint64_t *bits);
+
+/*
+ * Choose the scan_newlines implementation for this CPU, and
+ * return its name ("avx2", "sse2" or "scalar"). "force", if not
+ * NULL, names the one to use instead, for benchmarks.
+ */
+extern const char *scan_init(const char *force);
+
+#define COMMAND_BAD      0
+#define COMMAND_START    1
+#define COMMAND_PERIODIC 2
+#define COMMAND_CHANGE   3
+#define COMMAND_CANCEL   4
+#define COMMAND_SLACK    5
+#define COMMAND_STATS    6
+#define COMMAND_LIST     7
+#define COMMAND_QUERY    8
+#define COMMAND_BULK     9
+
+typedef struct command_tag
+{
+    int op;             /* COMMAND_* */
+    int alarm_id;       /* list, change_group: the first id of the range */
+    int last;           /* list, change_group: the last */
+    int group_id;       /* query, change_group: -1 for every group */
+    int new_group;      /* change_group: -1 to keep each alarm's */
+    int seconds;        /* change_group: -1 if not given */
+    long slack;         /* -1 unless given */
+    int priority;       /* start, periodic: 0 unless given */
+    long from, to;      /* query: seconds from EPOCH; "to" is -1 for
+                           the next "from" seconds */
+    char *message;      /* into the line; not NUL-terminated */
+    size_t length;
+} command_t;
+
+/*
+ * Parse the "len" bytes at "line", which may end in a newline.
+ * Nothing outside them is read and nothing is written, so the line
+ * may lie in read-only memory; the message, if any, is left where
+ * it is, "length" bytes long. Returns the command's op,
+ * COMMAND_BAD if it is not a command.
+ */
+extern int command_parse(char *line, size_t len, command_t *command);
+
+#endif
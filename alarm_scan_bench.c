@@ -0,0 +1,282 @@
+/*
+ * alarm_scan_bench.c
+ *
+ * Throughput of the batch input path (alarm_scan.c) over a block of
+ * generated command lines, in GB/s of input:
+ *
+ *      split   find every line: memchr from newline to newline, as
+ *              the console did before, against scan_newlines with
+ *              each implementation the CPU supports
+ *      parse   recognise each line: the sscanf formats the console
+ *              used to try in turn, against command_parse
+ *
+ * Before measuring, it checks command_parse against a table of
+ * lines with known answers, and stops if any is wrong.
+ *
+ * Build with "make -f make bench" and run "./alarm_scan_bench [MB]".
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "alarm_scan.h"
+
+#define BLOCK 65536
+
+static double now_sec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Lines like a batch load: mostly starts, with the other commands
+ * mixed in, and messages from a word to a few hundred bytes.
+ */
+static size_t generate(char *buf, size_t size)
+{
+    size_t len = 0;
+    int i, n, words;
+
+    for (i = 0; len + 1024 < size; i++)
+    {
+        switch (rand() % 8)
+        {
+        case 0:
+            n = sprintf(buf + len, "change(%d): group(%d) %d changed %d\n",
+                        rand(), rand() % 100, rand() % 3600, i);
+            break;
+        case 1:
+            n = sprintf(buf + len, "cancel(%d)\n", rand());
+            break;
+        case 2:
+            n = sprintf(buf + len, "periodic(%d): group(%d) %d tick\n",
+                        i, rand() % 100, 1 + rand() % 60);
+            break;
+        case 3:
+            n = sprintf(buf + len, "start(%d): group(%d) %d slack(%d) lax %d\n",
+                        i, rand() % 100, rand() % 3600, rand() % 1000, i);
+            break;
+        default:
+            n = sprintf(buf + len, "start(%d): group(%d) %d alarm",
+                        i, rand() % 100, rand() % 3600);
+            for (words = rand() % 40; words > 0; words--)
+                n += sprintf(buf + len + n, " word%d", rand() % 1000);
+            buf[len + n++] = '\n';
+            break;
+        }
+        len += n;
+    }
+    return len;
+}
+
+static long split_memchr(char *buf, size_t len)
+{
+    char *start, *newline, *end;
+    size_t block;
+    long lines = 0;
+
+    for (block = 0; block < len; block += BLOCK)
+    {
+        start = buf + block;
+        end = start + (len - block < BLOCK ? len - block : BLOCK);
+        while ((newline = memchr(start, '\n', end - start)) != NULL)
+        {
+            lines += newline - start;
+            start = newline + 1;
+        }
+    }
+    return lines;
+}
+
+static long split_bitmap(char *buf, size_t len)
+{
+    static uint64_t newlines[BLOCK / 64];
+    uint64_t bits;
+    char *start, *newline, *base;
+    size_t block, size, word;
+    long lines = 0;
+
+    for (block = 0; block < len; block += BLOCK)
+    {
+        base = start = buf + block;
+        size = len - block < BLOCK ? len - block : BLOCK;
+        scan_newlines(base, size, newlines);
+        for (word = 0; word * 64 < size; word++)
+        {
+            for (bits = newlines[word]; bits != 0; bits &= bits - 1)
+            {
+                newline = base + word * 64 + __builtin_ctzll(bits);
+                lines += newline - start;
+                start = newline + 1;
+            }
+        }
+    }
+    return lines;
+}
+
+/*
+ * The console's parse before alarm_scan.c: try each format in turn
+ * on the NUL-terminated line.
+ */
+static int parse_sscanf(char *line)
+{
+    int id, group, seconds, offset;
+    long slack;
+
+    if (sscanf(line, "slack: group(%d) %ld", &group, &slack) == 2)
+        return COMMAND_SLACK;
+    if (sscanf(line, "cancel(%d)", &id) == 1)
+        return COMMAND_CANCEL;
+    if (strncmp(line, "stats", 5) == 0)
+        return COMMAND_STATS;
+    if ((offset = -1, sscanf(line, "start(%d): group(%d) %d slack(%ld) %n",
+                             &id, &group, &seconds, &slack, &offset) == 4)
+        && line[offset] != '\0')
+        return COMMAND_START;
+    if ((offset = -1, sscanf(line, "start(%d): group(%d) %d %n",
+                             &id, &group, &seconds, &offset) == 3)
+        && line[offset] != '\0')
+        return COMMAND_START;
+    if ((offset = -1, sscanf(line, "periodic(%d): group(%d) %d %n",
+                             &id, &group, &seconds, &offset) == 3)
+        && line[offset] != '\0' && seconds > 0)
+        return COMMAND_PERIODIC;
+    if ((offset = -1, sscanf(line, "change(%d): group(%d) %d %n",
+                             &id, &group, &seconds, &offset) == 3)
+        && line[offset] != '\0')
+        return COMMAND_CHANGE;
+    return COMMAND_BAD;
+}
+
+/*
+ * Lines command_parse must get right however fast it is, with the
+ * op each must give.
+ */
+static const struct
+{
+    const char *line;
+    int op;
+} cases[] = {
+    { "start(1): group(2) 10 hello\n", COMMAND_START },
+    { "start(1): group(2) 10 slack(300) priority(5) hello\n", COMMAND_START },
+    { "start(1): group(2) 10 slack(300)\n", COMMAND_START },
+    { "start(1): group(2) 10\n", COMMAND_BAD },
+    { "periodic(1): group(2) 10 priority(3) tick\n", COMMAND_PERIODIC },
+    { "periodic(1): group(1) 0 hello\n", COMMAND_BAD },
+    { "periodic(1): group(1) -5 hello\n", COMMAND_BAD },
+    { "periodic(1): group(1) 0 priority(3) hello\n", COMMAND_BAD },
+    { "change(1): group(2) 0 moved\n", COMMAND_CHANGE },
+    { "cancel(7)\n", COMMAND_CANCEL },
+    { "slack: group(3) 500\n", COMMAND_SLACK },
+    { "list(1-5)\n", COMMAND_LIST },
+    { "query(60): group(7)\n", COMMAND_QUERY },
+    { "change_group(1-9): group(*) group(4) 30\n", COMMAND_BULK },
+    { "stats\n", COMMAND_STATS },
+    { "bogus\n", COMMAND_BAD },
+};
+
+/*
+ * Run the cases; returns how many failed, after printing each.
+ */
+static int check_parse(void)
+{
+    command_t command;
+    char line[128];
+    int i, op, failed = 0;
+
+    for (i = 0; i < (int)(sizeof(cases) / sizeof(cases[0])); i++)
+    {
+        strcpy(line, cases[i].line);
+        op = command_parse(line, strlen(line), &command);
+        if (op != cases[i].op)
+        {
+            printf("parse check %d: gave %d, expected %d: %s",
+                   i, op, cases[i].op, cases[i].line);
+            failed++;
+        }
+    }
+    return failed;
+}
+
+int main(int argc, char *argv[])
+{
+    static const char *impls[] = { "scalar", "sse2", "avx2" };
+    size_t size, len;
+    char *buf, *lines, *start, *end, *newline;
+    double start_time, elapsed, gb;
+    long sink, expect, parsed, bad;
+    command_t command;
+    int i, rounds, r;
+
+    scan_init(NULL);
+    if (check_parse() != 0)
+        return 1;
+
+    size = (argc > 1 ? atoi(argv[1]) : 64) << 20;
+    if (size < BLOCK)
+        size = BLOCK;
+    buf = malloc(size);
+    lines = malloc(size + 1);
+    if (buf == NULL || lines == NULL)
+    {
+        perror("malloc");
+        return 1;
+    }
+    srand(1);
+    len = generate(buf, size);
+    gb = len / 1e9;
+    rounds = 10;
+    printf("%.1f MB of commands, best machine choice %s\n",
+           len / 1e6, scan_init(NULL));
+
+    expect = split_memchr(buf, len);
+    start_time = now_sec();
+    for (r = 0; r < rounds; r++)
+        sink = split_memchr(buf, len);
+    elapsed = now_sec() - start_time;
+    printf("split: memchr  %6.2f GB/s\n", gb * rounds / elapsed);
+    for (i = 0; i < 3; i++)
+    {
+        if (strcmp(scan_init(impls[i]), impls[i]) != 0)
+            continue;
+        start_time = now_sec();
+        for (r = 0; r < rounds; r++)
+            sink = split_bitmap(buf, len);
+        elapsed = now_sec() - start_time;
+        printf("split: %-7s %6.2f GB/s%s\n", impls[i], gb * rounds / elapsed,
+               sink == expect ? "" : "  (lines disagree)");
+    }
+    scan_init(NULL);
+
+    /*
+     * sscanf needs each line NUL-terminated; command_parse takes it
+     * as it lies.
+     */
+    memcpy(lines, buf, len);
+    for (newline = lines; (newline = memchr(newline, '\n', lines + len - newline)) != NULL; )
+        *newline++ = '\0';
+    start_time = now_sec();
+    bad = 0;
+    for (start = lines, end = lines + len; start < end; start += strlen(start) + 1)
+        bad += parse_sscanf(start) == COMMAND_BAD;
+    elapsed = now_sec() - start_time;
+    printf("parse: sscanf  %6.2f GB/s\n", gb / elapsed);
+
+    start_time = now_sec();
+    parsed = 0;
+    for (r = 0; r < rounds; r++)
+    {
+        for (start = buf, end = buf + len; start < end; start = newline + 1)
+        {
+            newline = memchr(start, '\n', end - start);
+            parsed += command_parse(start, newline + 1 - start, &command) == COMMAND_BAD;
+        }
+    }
+    elapsed = now_sec() - start_time;
+    printf("parse: command %6.2f GB/s%s\n", gb * rounds / elapsed,
+           parsed == bad * rounds ? "" : "  (parsers disagree)");
+    return sink == 42;
+}
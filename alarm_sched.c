@@ -0,0 +1,2620 @@
+/*
+ * alarm_sched.c
+ *
+ * The alarm scheduler behind New_Alarm_Cond.c, as a library: see
+ * alarm_sched.h for the interface. Everything the program used to
+ * keep in globals -- the alarm store, the id index, the group
+ * settings, the mutex and condition variable -- lives in one
+ * alarm_sched_t.
+ *
+ * The timer thread waits on the condition variable, with a
+ * timeout that corresponds to the earliest wakeup point. If a
+ * caller enters an earlier one, it signals the condition variable
+ * so that the timer thread wakes up and recomputes. A scheduler on
+ * a virtual clock has no timer thread; alarm_sched_advance does
+ * its work on the caller's thread instead.
+ */
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <limits.h>
+#include "errors.h"
+#include "alarm_sched.h"
+
+/*
+ * The alarm store is laid out as a structure of arrays. An alarm
+ * is a slot number, and each field is an array indexed by slot.
+ * The fields read on every firing -- the deadline, the id, group
+ * and interval -- are packed densely; fields read only when an
+ * alarm is started, changed or reported sit in a separate cold
+ * array at the same index. Finding the alarms due is the job of
+ * the deadline queue below, not of a scan over the store.
+ *
+ * Freed slots are reused, most recently freed first, before the
+ * store grows; memory under churn stays at the peak number of
+ * alarms alive at once. Slots are only stable while the mutex is
+ * held: growing the store moves the arrays.
+ */
+#define ALARM_NEVER LLONG_MAX
+#define ALARM_RETRY 10          /* msec between drains short of memory */
+#define ALARM_STORE_MIN 64
+
+/*
+ * Messages live out of line in an arena, one length-prefixed
+ * entry per distinct text. Alarms with identical messages share
+ * an entry, found through the intern table by hash, and each
+ * entry counts its references: the alarms using it, firings being
+ * delivered and alarm_info_t snapshots handed out.
+ *
+ * Entries are bump-allocated from MESSAGE_CHUNK chunks, rounded up
+ * to a power-of-two size class; a freed entry goes on its class's
+ * free list and is reused by the next message of that class.
+ * Entries never move, so a reference keeps its text valid without
+ * the mutex. Messages too big for MESSAGE_CLASSES are malloc'd on
+ * their own.
+ */
+#define MESSAGE_CHUNK   65536
+#define MESSAGE_MIN     32      /* smallest size class, bytes */
+#define MESSAGE_CLASSES 11      /* 32 bytes .. 32 KB */
+#define MESSAGE_HASH_MIN 64
+
+typedef struct message_tag
+{
+    struct message_tag *link;  /* next in hash bucket, or on free list */
+    unsigned refs;
+    unsigned hash;
+    int size_class;            /* -1 if malloc'd on its own */
+    size_t length;             /* bytes of text, not counting the NUL */
+    char text[];
+} message_t;
+
+typedef struct message_chunk_tag
+{
+    struct message_chunk_tag *link;
+    char space[] __attribute__((aligned(16)));
+} message_chunk_t;
+
+/*
+ * The ordered indexes: every alarm has one node, which sits on two
+ * skip lists at once -- the id index, ordered by alarm_id, and the
+ * deadline queue, ordered by wakeup point and then id. A node
+ * carries a tower of links for each, of the same height. The
+ * timer thread takes the earliest wakeup from the head of the
+ * queue and the alarms due from its front, so a firing costs
+ * O(log n) however many alarms there are, and which alarms are due
+ * no longer depends on where they sit in id order.
+ *
+ * Nodes copy what a scan reports, so that scans read nodes alone
+ * and never the store, whose arrays move as it grows. Writers
+ * change the lists only under the mutex, as they do the store;
+ * readers take no lock at all, so a scan never holds up a start or
+ * cancel, nor one of them a scan.
+ *
+ * That works because a published node never changes. A change,
+ * or a periodic alarm moving on to its next deadline, publishes a
+ * replacement on both lists, then unlinks the old node. In id
+ * order the replacement goes just before the old node; a reader
+ * sees one or the other, or both one after the other, which it
+ * skips as a repeated id. Insertion fills in a node's links before
+ * a release store makes it reachable, and unlinking leaves the
+ * node's own links alone, so a reader standing on it walks on.
+ *
+ * Unlinked nodes go on a limbo list and are recycled once no
+ * reader can still be on them. Each reader announces the epoch it
+ * started in, in one of SKIP_READERS slots; each unlink is stamped
+ * with the epoch and moves it on. A node is recycled when it was
+ * unlinked before every announced epoch: it goes to the pool,
+ * where the next node of its height or less is taken from, so a
+ * periodic alarm firing again and again settles into reusing the
+ * same few nodes rather than calling malloc and free each time.
+ */
+#define SKIP_LEVELS  16         /* enough for 4^16 alarms */
+#define SKIP_READERS 64         /* concurrent range scans */
+#define SKIP_LIMBO   64         /* unlinked nodes between collections */
+
+typedef struct skip_node_tag
+{
+    int alarm_id;
+    int group_id;
+    int seconds;
+    int interval;
+    int priority;
+    long slack;
+    long long expires;
+    long long wake;             /* the deadline queue's key, with alarm_id */
+    int slot;                   /* writers only: the alarm's store slot */
+    message_t *message;         /* holds a reference */
+    unsigned long retired;      /* epoch it was unlinked in */
+    struct skip_node_tag *limbo;
+    int levels;
+    int height;                 /* levels allocated for, at least "levels" */
+    _Atomic(struct skip_node_tag *) next[];  /* id links, then deadline links */
+} skip_node_t;
+
+#define SKIP_BY_ID(node, i)   (&(node)->next[i])
+#define SKIP_BY_TIME(node, i) (&(node)->next[(node)->levels + (i)])
+
+typedef struct alarm_cold_tag
+{
+    int seconds;
+    int priority;  /* ALARM_PRIORITY_MIN to _MAX */
+    long slack;  /* msec it may fire late */
+    message_t *message;
+    skip_node_t *node;  /* in the ordered indexes */
+} alarm_cold_t;
+
+typedef struct alarm_store_tag
+{
+    long long *expires;  /* deadline, msec from EPOCH */
+    int *alarm_id;
+    int *group_id;
+    int *interval;       /* seconds between firings; 0 for a one-shot alarm */
+    alarm_cold_t *cold;
+    int *hash_link;      /* next slot in the same hash bucket, or -1 */
+    int *shed_pos;       /* index in its priority's shed heap, or -1 */
+    int *free;           /* stack of free slots below "high" */
+    int free_count;
+    int high;            /* slots at and above this have never been used */
+    int size;            /* slots allocated */
+} alarm_store_t;
+
+/*
+ * Per-group timing policy. Groups without an entry use the
+ * scheduler's default slack.
+ */
+typedef struct group_tag
+{
+    struct group_tag *link;
+    int group_id;
+    long slack;  /* msec */
+} group_t;
+
+/*
+ * A firing waiting to be delivered. The timer thread collects
+ * these under the mutex and calls the callback for each after
+ * releasing it, so each holds a reference to its message.
+ */
+typedef struct fired_tag
+{
+    alarm_event_t event;
+    message_t *message;
+    int slot;               /* while draining */
+    skip_node_t *node;      /* while draining: a periodic alarm's next node */
+} fired_t;
+
+#define ALARM_HASH_MIN 64
+
+struct alarm_sched
+{
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    pthread_t thread;
+    int stopping;
+    int clock;              /* ALARM_CLOCK_* */
+    long long clock_now;    /* msec from EPOCH; a virtual clock's time */
+
+    alarm_callback_t callback;
+    void *arg;
+
+    alarm_store_t store;
+    long long current;      /* msec from EPOCH the timer thread waits for */
+    long slack;             /* default msec an alarm may fire late */
+    unsigned oneshots;      /* one-shot alarms pending */
+    unsigned capacity;      /* most alarms pending at once; 0 for no limit */
+    int policy;             /* ALARM_LIMIT_*: what a start does at capacity */
+    pthread_cond_t room;    /* count fell below capacity */
+    unsigned room_waiters;  /* starts waiting on "room" */
+
+    /*
+     * For ALARM_LIMIT_SHED: a heap of slots for each priority, the
+     * one due last on top, so that the alarm to drop -- the lowest
+     * priority's last due -- is found without a scan.
+     */
+    int *shed[ALARM_PRIORITIES];
+    int shed_count[ALARM_PRIORITIES];
+    int shed_size[ALARM_PRIORITIES];
+    group_t *groups;
+    alarm_stats_t stats;
+
+    /*
+     * Index from alarm_id to slot, so that change and cancel find
+     * their alarm without scanning the store. Buckets hold the
+     * first slot of a chain, or -1. The table doubles whenever it
+     * holds more alarms than buckets.
+     */
+    int *hash;
+    unsigned hash_size;
+    unsigned count;
+
+    fired_t *fired;         /* timer thread's delivery buffer */
+    int fired_size;
+    int starved;            /* the last drain fired nothing, for want of memory */
+
+    /*
+     * Nodes out of limbo wait in "pool" for reuse, one list per
+     * height. Real-time mode (alarm_sched_create_realtime) uses
+     * only full-height nodes, which writers keep at "reserve" or
+     * more, and messages that must go back to malloc wait on
+     * "defer" for a writer to free them.
+     */
+    int reserve;            /* 0 unless real-time */
+    skip_node_t *pool[SKIP_LEVELS];  /* by height - 1, linked through limbo */
+    int pool_count;
+    message_t *defer;
+
+    skip_node_t *skip;      /* head of both ordered indexes */
+    unsigned skip_seed;
+    skip_node_t *limbo;     /* unlinked, waiting for readers to leave */
+    int limbo_count;
+    int limbo_limit;        /* count at which to collect next */
+    atomic_ulong epoch;
+    atomic_ulong readers[SKIP_READERS];  /* epoch each scan started in; 0 if idle */
+
+    message_chunk_t *chunks;
+    char *arena_next, *arena_end;  /* unused part of the newest chunk */
+    message_t *message_free[MESSAGE_CLASSES];
+    message_t **messages;          /* intern table */
+    unsigned message_size;
+    unsigned message_count;
+};
+
+/*
+ * Current wall-clock time in milliseconds since the Epoch.
+ * pthread_cond_timedwait measures its timeout against
+ * CLOCK_REALTIME, so deadlines are compared on the same clock.
+ */
+static long long now_msec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+ * The scheduler's time in milliseconds since the Epoch: the wall
+ * clock, or wherever alarm_sched_advance last left a virtual one.
+ *
+ * LOCKING PROTOCOL: caller must hold sched->mutex.
+ */
+static long long sched_now(alarm_sched_t *sched)
+{
+    return sched->clock == ALARM_CLOCK_VIRTUAL ? sched->clock_now : now_msec();
+}
+
+/*
+ * The scheduler whose timer thread this is, if any.
+ */
+static __thread alarm_sched_t *timer_sched;
+
+/*
+ * Count an allocation made on the timer thread, where real-time
+ * mode should have made none.
+ *
+ * LOCKING PROTOCOL: caller must hold sched->mutex.
+ */
+static void timer_alloc(alarm_sched_t *sched)
+{
+    if (timer_sched == sched)
+        sched->stats.timer_allocs++;
+}
+
+/*
+ * Grow one array of the store to "size" entries; the array is left
+ * as it was if that fails.
+ */
+#define STORE_RESIZE(store, field, size) \
+    do \
+    { \
+        void *array = realloc((store)->field, (size) * sizeof(*(store)->field)); \
+        if (array == NULL) \
+            return ENOMEM; \
+        (store)->field = array; \
+    } while (0)
+
+/*
+ * Double the store. Returns 0, or ENOMEM with the store the size it
+ * was (some arrays may have grown, which does no harm).
+ *
+ * LOCKING PROTOCOL: caller must hold sched->mutex.
+ */
+static int store_grow(alarm_store_t *store)
+{
+    int size;
+
+    size = store->size ? store->size * 2 : ALARM_STORE_MIN;
+    STORE_RESIZE(store, expires, size);
+    STORE_RESIZE(store, alarm_id, size);
+    STORE_RESIZE(store, group_id, size);
+    STORE_RESIZE(store, interval, size);
+    STORE_RESIZE(store, cold, size);
+    STORE_RESIZE(store, hash_link, size);
+    STORE_RESIZE(store, shed_pos, size);
+    STORE_RESIZE(store, free, size);
+    store->size = size;
+    return 0;
+}
+
+static unsigned message_hash(const char *text, size_t length)
+{
+    unsigned hash = 2166136261u;
+    size_t i;
+
+    for (i = 0; i < length; i++)
+        hash = (hash ^ (unsigned char)text[i]) * 16777619u;
+    return hash;
+}
+
+/*
+ * Carve an entry for "size" bytes out of the arena, or return NULL
+ * if there is no memory for it.
+ *
+ * LOCKING PROTOCOL: caller must hold sched->mutex.
+ */
+static message_t *message_alloc(alarm_sched_t *sched, size_t size)
+{
+    message_chunk_t *chunk;
+    message_t *message;
+    int size_class;
+
+    for (size_class = 0; size_class < MESSAGE_CLASSES; size_class++)
+        if (size <= (size_t)MESSAGE_MIN << size_class)
+            break;
+    if (size_class == MESSAGE_CLASSES)
+    {
+        message = (message_t *)malloc(size);
+        if (message == NULL)
+            return NULL;
+        message->size_class = -1;
+        return message;
+    }
+    message = sched->message_free[size_class];
+    if (message != NULL)
+    {
+        sched->message_free[size_class] = message->link;
+        return message;
+    }
+    size = (size_t)MESSAGE_MIN << size_class;
+    if (sched->arena_next == NULL || (size_t)(sched->arena_end - sched->arena_next) < size)
+    {
+        chunk = (message_chunk_t *)malloc(sizeof(message_chunk_t) + MESSAGE_CHUNK);
+        if (chunk == NULL)
+            return NULL;
+        chunk->link = sched->chunks;
+        sched->chunks = chunk;
+        sched->arena_next = chunk->space;
+        sched->arena_end = chunk->space + MESSAGE_CHUNK;
+    }
+    message = (message_t *)sched->arena_next;
+    sched->arena_next += size;
+    message->size_class = size_class;
+    return message;
+}
+
+/*
+ * Return a reference to the arena entry for "length" bytes of
+ * "text", creating it if no alarm holds that text yet; NULL if
+ * there is no memory to.
+ *
+ * LOCKING PROTOCOL: caller must hold sched->mutex.
+ */
+static message_t *message_intern(alarm_sched_t *sched, const char *text,
+                                 size_t length)
+{
+    message_t **table, *message, *move;
+    unsigned hash, size, i, index;
+
+    hash = message_hash(text, length);
+    if (sched->messages != NULL)
+    {
+        message = sched->messages[hash & (sched->message_size - 1)];
+        for (; message != NULL; message = message->link)
+        {
+            if (message->hash == hash && message->length == length
+                && memcmp(message->text, text, length) == 0)
+            {
+                message->refs++;
+                return message;
+            }
+        }
+    }
+
+    if (sched->message_count >= sched->message_size)
+    {
+        size = sched->message_size ? sched->message_size * 2 : MESSAGE_HASH_MIN;
+        table = (message_t **)calloc(size, sizeof(message_t *));
+        if (table == NULL)
+            return NULL;
+        for (i = 0; i < sched->message_size; i++)
+        {
+            for (message = sched->messages[i]; message != NULL; message = move)
+            {
+                move = message->link;
+                index = message->hash & (size - 1);
+                message->link = table[index];
+                table[index] = message;
+            }
+        }
+        free(sched->messages);
+        sched->messages = table;
+        sched->message_size = size;
+    }
+
+    message = message_alloc(sched, sizeof(message_t) + length + 1);
+    if (message == NULL)
+        return NULL;
+    message->refs = 1;
+    message->hash = hash;
+    message->length = length;
+    memcpy(message->text, text, length);
+    message->text[length] = '\0';
+    index = hash & (sched->message_size - 1);
+    message->link = sched->messages[index];
+    sched->messages[index] = message;
+    sched->message_count++;
+    return message;
+}
+
+/*
+ * Drop a reference, freeing the entry with the last one.
+ *
+ * LOCKING PROTOCOL: caller must hold sched->mutex.
+ */
+static void message_release(alarm_sched_t *sched, message_t *message)
+{
+    message_t **last;
+
+    if (--message->refs > 0)
+        return;
+    last = &sched->messages[message->hash & (sched->message_size - 1)];
+    while (*last != message)
+        last = &(*last)->link;
+    *last = message->link;
+    sched->message_count--;
+    if (message->size_class < 0)
+    {
+        if (sched->reserve > 0 && timer_sched == sched)
+        {
+            message->link = sched->defer;
+            sched->defer = message;
+            return;
+        }
+        free(message);
+        return;
+    }
+    message->link = sched->message_free[message->size_class];
+    sched->message_free[message->size_class] = message;
+}
+
+/*
+ * Make sure there is a slot for alarm_alloc to take, growing the
+ * store if there is none. Returns 0 or ENOMEM.
+ *
+ * LOCKING PROTOCOL: caller must hold sched->mutex.
+ */
+static int alarm_reserve(alarm_sched_t *sched)
+{
+    alarm_store_t *store = &sched->store;
+
+    if (store->free_count == 0 && store->high == store->size)
+        return store_grow(store);
+    return 0;
+}
+
+/*
+ * Take a free slot; alarm_reserve has made sure of one.
+ *
+ * LOCKING PROTOCOL: caller must hold sched->mutex.
+ */
+static int alarm_alloc(alarm_sched_t *sched)
+{
+    alarm_store_t *store = &sched->store;
+
+    if (store->free_count > 0)
+        return store->free[--store->free_count];
+    return store->high++;
+}
+
+/*
+ * Return a slot to the free stack.
+ *
+ * LOCKING PROTOCOL: caller must hold sched->mutex.
+ */
+static void alarm_free(alarm_sched_t *sched, int slot)
+{
+    alarm_store_t *store = &sched->store;
+
+    store->free[store->free_count++] = slot;
+}
+
+static void alarm_snapshot(alarm_sched_t *sched, int slot, alarm_info_t *info)
+{
+    alarm_store_t *store = &sched->store;
+
+    if (info == NULL)
+        return;
+    store->cold[slot].message->refs++;
+    info->alarm_id = store->alarm_id[slot];
+    info->group_id = store->group_id[slot];
+    info->seconds = store->cold[slot].seconds;
+    info->interval = store->interval[slot];
+    info->priority = store->cold[slot].priority;
+    info->slack = store->cold[slot].slack;
+    info->time = store->expires[slot] / 1000;
+    info->message = store->cold[slot].message->text;
+    info->length = store->cold[slot].message->length;
+}
+
+/*
+ * Slack for a group: its own setting if one was given, otherwise
+ * the scheduler default.
+ *
+ * LOCKING PROTOCOL: caller must hold sched->mutex.
+ */
+static long group_slack(alarm_sched_t *sched, int group_id)
+{
+    group_t *group;
+
+    for (group = sched->groups; group != NULL; group = group->link)
+        if (group->group_id == group_id)
+            return group->slack;
+    return sched->slack;
+}
+
+/*
+ * The point (msec from EPOCH) at which the timer thread should
+ * wake for an alarm due at "expires". Any point in [expires,
+ * expires + slack] is acceptable; as with kernel timer slack,
+ * pick the one with the most trailing zero bits in that window.
+ * Alarms with overlapping windows then round to the same point
+ * and are handled by one wakeup instead of one apiece.
+ */
+static long long alarm_wakeup(long long expires, long slack)
+{
+    long long limit, mask;
+    int bit;
+
+    if (slack <= 0)
+        return expires;
+    limit = expires + slack;
+    mask = expires ^ limit;
+    for (bit = 0; (mask >> bit) > 1; bit++)
+        ;
+    mask = (1LL << bit) - 1;
+    return limit & ~mask;
+}
+
+/*
+ * A level for a new node: 1, then one more with probability 1/4
+ * each, up to SKIP_LEVELS.
+ *
+ * LOCKING PROTOCOL: caller must hold sched->mutex.
+ */
+static int skip_random_level(alarm_sched_t *sched)
+{
+    unsigned bits;
+    int levels;
+
+    sched->skip_seed ^= sched->skip_seed << 13;
+    sched->skip_seed ^= sched->skip_seed >> 17;
+    sched->skip_seed ^= sched->skip_seed << 5;
+    bits = sched->skip_seed;
+    for (levels = 1; levels < SKIP_LEVELS && (bits & 3) == 0; levels++)
+        bits >>= 2;
+    return levels;
+}
+
+static skip_node_t *skip_node_alloc(int levels)
+{
+    skip_node_t *node;
+    int i;
+
+    node = (skip_node_t *)malloc(sizeof(skip_node_t)
+                                 + 2 * levels * sizeof(skip_node_t *));
+    if (node == NULL)
+        return NULL;
+    node->levels = levels;
+    node->height = levels;
+    for (i = 0; i < 2 * levels; i++)
+        atomic_init(&node->next[i], NULL);
+    return node;
+}
+
+/*
+ * A node for skip_make, from the pool if it has one tall enough.
+ * In real-time mode every node is allocated at full height,
+ * whatever height it is given, so that any node in the pool will
+ * do; the timer thread's replacements for periodic alarms then
+ * come from the pool rather than from malloc. Returns NULL if
+ * there is no memory for a node.
+ *
+ * LOCKING PROTOCOL: caller must hold sched->mutex.
+ */
+static skip_node_t *skip_node_get(alarm_sched_t *sched, int levels)
+{
+    skip_node_t *node;
+    int height, i;
+
+    height = sched->reserve > 0 ? SKIP_LEVELS : levels;
+    for (i = height - 1; i < SKIP_LEVELS && sched->pool[i] == NULL; i++)
+        ;
+    if (i == SKIP_LEVELS)
+    {
+        timer_alloc(sched);
+        node = skip_node_alloc(height);
+        if (node == NULL)
+            return NULL;
+    }
+    else
+    {
+        node = sched->pool[i];
+        sched->pool[i] = node->limbo;
+        sched->pool_count--;
+    }
+    node->levels = levels;
+    for (i = 0; i < 2 * levels; i++)
+        atomic_init(&node->next[i], NULL);
+    return node;
+}
+
+/*
+ * Keep a node for reuse. Outside real-time mode the pool holds no
+ * more than one node per alarm set, plus SKIP_LIMBO; a node beyond
+ * that is freed.
+ *
+ * LOCKING PROTOCOL: caller must hold sched->mutex.
+ */
+static void skip_node_put(alarm_sched_t *sched, skip_node_t *node)
+{
+    if (sched->reserve == 0
+        && sched->pool_count >= (int)sched->count + SKIP_LIMBO)
+    {
+        free(node);
+        return;
+    }
+    node->limbo = sched->pool[node->height - 1];
+    sched->pool[node->height - 1] = node;
+    sched->pool_count++;
+}
+
+/*
+ * Bring the pool back up to the reserve, trim it if a burst left
+ * it far above, and free deferred messages: the allocation the
+ * timer thread would otherwise do, done by a writer as it leaves.
+ * Short of memory, the pool stays short, and the timer thread
+ * allocates for itself. With no reserve, as when the scheduler is
+ * going away, the pool is emptied.
+ *
+ * LOCKING PROTOCOL: caller must hold sched->mutex.
+ */
+static void sched_refill(alarm_sched_t *sched)
+{
+    skip_node_t *node;
+    message_t *message;
+    int i;
+
+    while (sched->pool_count < sched->reserve
+           && (node = skip_node_alloc(SKIP_LEVELS)) != NULL)
+        skip_node_put(sched, node);
+    for (i = 0; i < SKIP_LEVELS && sched->pool_count > 2 * sched->reserve; i++)
+    {
+        while (sched->pool_count > 2 * sched->reserve
+               && (node = sched->pool[i]) != NULL)
+        {
+            sched->pool[i] = node->limbo;
+            sched->pool_count--;
+            free(node);
+        }
+    }
+    while ((message = sched->defer) != NULL)
+    {
+        sched->defer = message->link;
+        free(message);
+    }
+}
+
+/*
+ * Find, at every level of the id index, the last node whose id is
+ * below "alarm_id".
+ *
+ * LOCKING PROTOCOL: caller must hold sched->mutex.
+ */
+static void skip_search(alarm_sched_t *sched, int alarm_id,
+                        skip_node_t **update)
+{
+    skip_node_t *node, *next;
+    int i;
+
+    node = sched->skip;
+    for (i = SKIP_LEVELS - 1; i >= 0; i--)
+    {
+        while ((next = atomic_load_explicit(SKIP_BY_ID(node, i),
+                                            memory_order_relaxed)) != NULL
+               && next->alarm_id < alarm_id)
+            node = next;
+        update[i] = node;
+    }
+}
+
+/*
+ * skip_search for ids in ascending order, as skip_search_time_from
+ * below is for deadlines.
+ *
+ * LOCKING PROTOCOL: caller must hold sched->mutex.
+ */
+static void skip_search_from(alarm_sched_t *sched, int alarm_id,
+                             skip_node_t **update)
+{
+    skip_node_t *node, *next;
+    int i;
+
+    node = sched->skip;
+    for (i = SKIP_LEVELS - 1; i >= 0; i--)
+    {
+        if (update[i] != sched->skip
+            && (node == sched->skip || node->alarm_id < update[i]->alarm_id))
+            node = update[i];
+        while ((next = atomic_load_explicit(SKIP_BY_ID(node, i),
+                                            memory_order_relaxed)) != NULL
+               && next->alarm_id < alarm_id)
+            node = next;
+        update[i] = node;
+    }
+}
+
+/*
+ * Whether "node" comes before the key (wake, alarm_id) in the
+ * deadline queue.
+ */
+static int skip_earlier(const skip_node_t *node, long long wake, int alarm_id)
+{
+    return node->wake < wake || (node->wake == wake && node->alarm_id < alarm_id);
+}
+
+/*
+ * Find, at every level of the deadline queue, the last node before
+ * the key (wake, alarm_id).
+ *
+ * LOCKING PROTOCOL: caller must hold sched->mutex.
+ */
+static void skip_search_time(alarm_sched_t *sched, long long wake,
+                             int alarm_id, skip_node_t **update)
+{
+    skip_node_t *node, *next;
+    int i;
+
+    node = sched->skip;
+    for (i = SKIP_LEVELS - 1; i >= 0; i--)
+    {
+        while ((next = atomic_load_explicit(SKIP_BY_TIME(node, i),
+                                            memory_order_relaxed)) != NULL
+               && skip_earlier(next, wake, alarm_id))
+            node = next;
+        update[i] = node;
+    }
+}
+
+/*
+ * Whether slot "a" is due after slot "b": the order of the shed
+ * heaps, by deadline and then id.
+ */
+static int shed_later(alarm_store_t *store, int a, int b)
+{
+    return store->expires[a] > store->expires[b]
+        || (store->expires[a] == store->expires[b]
+            && store->alarm_id[a] > store->alarm_id[b]);
+}
+
+static void shed_put(alarm_sched_t *sched, int *heap, int i, int slot)
+{
+    heap[i] = slot;
+    sched->store.shed_pos[slot] = i;
+}
+
+/*
+ * Move the slot at heap[i] up or down to where it belongs.
+ *
+ * LOCKING PROTOCOL: caller must hold sched->mutex.
+ */
+static void shed_sift(alarm_sched_t *sched, int *heap, int count, int i)
+{
+    alarm_store_t *store = &sched->store;
+    int slot = heap[i], child;
+
+    while (i > 0 && shed_later(store, slot, heap[(i - 1) / 2]))
+    {
+        shed_put(sched, heap, i, heap[(i - 1) / 2]);
+        i = (i - 1) / 2;
+    }
+    while ((child = 2 * i + 1) < count)
+    {
+        if (child + 1 < count && shed_later(store, heap[child + 1], heap[child]))
+            child++;
+        if (!shed_later(store, heap[child], slot))
+            break;
+        shed_put(sched, heap, i, heap[child]);
+        i = child;
+    }
+    shed_put(sched, heap, i, slot);
+}
+
+/*
+ * Make sure "priority"'s shed heap has room for one more slot.
+ * Returns 0 or ENOMEM.
+ *
+ * LOCKING PROTOCOL: caller must hold sched->mutex.
+ */
+static int shed_reserve(alarm_sched_t *sched, int priority)
+{
+    int *heap, size;
+
+    if (sched->shed_count[priority] < sched->shed_size[priority])
+        return 0;
+    size = sched->shed_size[priority] ? sched->shed_size[priority] * 2 : ALARM_STORE_MIN;
+    heap = (int *)realloc(sched->shed[priority], size * sizeof(int));
+    if (heap == NULL)
+        return ENOMEM;
+    sched->shed[priority] = heap;
+    sched->shed_size[priority] = size;
+    return 0;
+}
+
+/*
+ * Add a slot to its priority's shed heap, which shed_reserve has
+ * made room in, or move it to its new place there after its
+ * deadline changed.
+ *
+ * LOCKING PROTOCOL: caller must hold sched->mutex.
+ */
+static void shed_update(alarm_sched_t *sched, int slot)
+{
+    alarm_store_t *store = &sched->store;
+    int priority = store->cold[slot].priority;
+    int *heap;
+
+    if (store->shed_pos[slot] < 0)
+        shed_put(sched, sched->shed[priority], sched->shed_count[priority]++, slot);
+    heap = sched->shed[priority];
+    shed_sift(sched, heap, sched->shed_count[priority], store->shed_pos[slot]);
+}
+
+/*
+ * LOCKING PROTOCOL: caller must hold sched->mutex.
+ */
+static void shed_remove(alarm_sched_t *sched, int slot)
+{
+    alarm_store_t *store = &sched->store;
+    int priority = store->cold[slot].priority;
+    int *heap = sched->shed[priority];
+    int i = store->shed_pos[slot], last;
+
+    store->shed_pos[slot] = -1;
+    last = heap[--sched->shed_count[priority]];
+    if (last == slot)
+        return;
+    shed_put(sched, heap, i, last);
+    shed_sift(sched, heap, sched->shed_count[priority], i);
+}
+
+/*
+ * Fill in "node", new and unlinked, from skip_node_get, with a copy
+ * of a slot's fields; it becomes the slot's node. Nodes are taken
+ * before the alarm is touched, so that a caller short of memory
+ * can still back out.
+ *
+ * LOCKING PROTOCOL: caller must hold sched->mutex.
+ */
+static skip_node_t *skip_make(alarm_sched_t *sched, int slot, skip_node_t *node)
+{
+    alarm_store_t *store = &sched->store;
+
+    node->alarm_id = store->alarm_id[slot];
+    node->group_id = store->group_id[slot];
+    node->seconds = store->cold[slot].seconds;
+    node->interval = store->interval[slot];
+    node->priority = store->cold[slot].priority;
+    node->slack = store->cold[slot].slack;
+    node->expires = store->expires[slot];
+    node->wake = alarm_wakeup(node->expires, node->slack);
+    node->slot = slot;
+    node->message = store->cold[slot].message;
+    node->message->refs++;
+    store->cold[slot].node = node;
+    shed_update(sched, slot);
+    return node;
+}
+
+/*
+ * Link a node in after update[i] at each of its levels of the id
+ * index. Its own links are set before a release store publishes
+ * it.
+ *
+ * LOCKING PROTOCOL: caller must hold sched->mutex.
+ */
+static void skip_link_id(skip_node_t *node, skip_node_t **update)
+{
+    int i;
+
+    for (i = 0; i < node->levels; i++)
+        atomic_store_explicit(SKIP_BY_ID(node, i),
+            atomic_load_explicit(SKIP_BY_ID(update[i], i), memory_order_relaxed),
+            memory_order_relaxed);
+    for (i = 0; i < node->levels; i++)
+        atomic_store_explicit(SKIP_BY_ID(update[i], i), node, memory_order_release);
+}
+
+/*
+ * The same for the deadline queue.
+ *
+ * LOCKING PROTOCOL: caller must hold sched->mutex.
+ */
+static void skip_link_time(skip_node_t *node, skip_node_t **update)
+{
+    int i;
+
+    for (i = 0; i < node->levels; i++)
+        atomic_store_explicit(SKIP_BY_TIME(node, i),
+            atomic_load_explicit(SKIP_BY_TIME(update[i], i), memory_order_relaxed),
+            memory_order_relaxed);
+    for (i = 0; i < node->levels; i++)
+        atomic_store_explicit(SKIP_BY_TIME(update[i], i), node, memory_order_release);
+}
+
+/*
+ * skip_search_time for a run of keys in ascending order: "update"
+ * holds the nodes found for the previous key, or the head, and
+ * each level starts from there rather than from the head. They
+ * must all still be in the queue.
+ *
+ * LOCKING PROTOCOL: caller must hold sched->mutex.
+ */
+static void skip_search_time_from(alarm_sched_t *sched, long long wake,
+                                  int alarm_id, skip_node_t **update)
+{
+    skip_node_t *node, *next;
+    int i;
+
+    node = sched->skip;
+    for (i = SKIP_LEVELS - 1; i >= 0; i--)
+    {
+        if (update[i] != sched->skip
+            && (node == sched->skip
+                || skip_earlier(node, update[i]->wake, update[i]->alarm_id)))
+            node = update[i];
+        while ((next = atomic_load_explicit(SKIP_BY_TIME(node, i),
+                                            memory_order_relaxed)) != NULL
+               && skip_earlier(next, wake, alarm_id))
+            node = next;
+        update[i] = node;
+    }
+}
+
+/*
+ * Publish "node" for a slot on both lists, ahead of any node with
+ * the same key.
+ *
+ * LOCKING PROTOCOL: caller must hold sched->mutex.
+ */
+static void skip_insert(alarm_sched_t *sched, int slot, skip_node_t *node)
+{
+    skip_node_t *update[SKIP_LEVELS];
+
+    skip_make(sched, slot, node);
+    skip_search(sched, node->alarm_id, update);
+    skip_link_id(node, update);
+    skip_search_time(sched, node->wake, node->alarm_id, update);
+    skip_link_time(node, update);
+}
+
+/*
+ * Free the limbo nodes that no reader can still reach.
+ *
+ * LOCKING PROTOCOL: caller must hold sched->mutex.
+ */
+static void skip_collect(alarm_sched_t *sched)
+{
+    skip_node_t **last, *node;
+    unsigned long oldest, epoch;
+    int i;
+
+    oldest = atomic_load(&sched->epoch);
+    for (i = 0; i < SKIP_READERS; i++)
+    {
+        epoch = atomic_load(&sched->readers[i]);
+        if (epoch != 0 && epoch < oldest)
+            oldest = epoch;
+    }
+    last = &sched->limbo;
+    while ((node = *last) != NULL)
+    {
+        if (node->retired < oldest)
+        {
+            *last = node->limbo;
+            sched->limbo_count--;
+            message_release(sched, node->message);
+            skip_node_put(sched, node);
+        }
+        else
+            last = &node->limbo;
+    }
+
+    /*
+     * A long scan can hold many nodes back; don't walk them all
+     * again after every few unlinks.
+     */
+    sched->limbo_limit = sched->limbo_count * 2 + SKIP_LIMBO;
+}
+
+/*
+ * Unlink a node from the id index, given the last nodes before its
+ * key. A replacement with the same key may sit between update[i]
+ * and the node; update[i] is left at the node's predecessor.
+ *
+ * LOCKING PROTOCOL: caller must hold sched->mutex.
+ */
+static void skip_cut_id(skip_node_t *node, skip_node_t **update)
+{
+    skip_node_t *next;
+    int i;
+
+    for (i = 0; i < node->levels; i++)
+    {
+        while ((next = atomic_load_explicit(SKIP_BY_ID(update[i], i),
+                                            memory_order_relaxed)) != node)
+            update[i] = next;
+        atomic_store_explicit(SKIP_BY_ID(update[i], i),
+            atomic_load_explicit(SKIP_BY_ID(node, i), memory_order_relaxed),
+            memory_order_release);
+    }
+}
+
+/*
+ * The same for the deadline queue.
+ *
+ * LOCKING PROTOCOL: caller must hold sched->mutex.
+ */
+static void skip_cut_time(skip_node_t *node, skip_node_t **update)
+{
+    skip_node_t *next;
+    int i;
+
+    for (i = 0; i < node->levels; i++)
+    {
+        while ((next = atomic_load_explicit(SKIP_BY_TIME(update[i], i),
+                                            memory_order_relaxed)) != node)
+            update[i] = next;
+        atomic_store_explicit(SKIP_BY_TIME(update[i], i),
+            atomic_load_explicit(SKIP_BY_TIME(node, i), memory_order_relaxed),
+            memory_order_release);
+    }
+}
+
+/*
+ * Put a node that is off both lists in limbo.
+ *
+ * LOCKING PROTOCOL: caller must hold sched->mutex.
+ */
+static void skip_retire(alarm_sched_t *sched, skip_node_t *node)
+{
+    node->retired = atomic_fetch_add(&sched->epoch, 1);
+    node->limbo = sched->limbo;
+    sched->limbo = node;
+    if (++sched->limbo_count >= sched->limbo_limit)
+        skip_collect(sched);
+}
+
+/*
+ * Unlink a node from both lists and put it in limbo.
+ *
+ * LOCKING PROTOCOL: caller must hold sched->mutex.
+ */
+static void skip_unlink(alarm_sched_t *sched, skip_node_t *node)
+{
+    skip_node_t *update[SKIP_LEVELS];
+
+    skip_search(sched, node->alarm_id, update);
+    skip_cut_id(node, update);
+    skip_search_time(sched, node->wake, node->alarm_id, update);
+    skip_cut_time(node, update);
+    skip_retire(sched, node);
+}
+
+/*
+ * LOCKING PROTOCOL: caller must hold sched->mutex.
+ */
+static void skip_remove(alarm_sched_t *sched, int slot)
+{
+    shed_remove(sched, slot);
+    skip_unlink(sched, sched->store.cold[slot].node);
+    sched->store.cold[slot].node = NULL;
+}
+
+/*
+ * Republish an alarm whose fields have changed: its old node may
+ * be in use by scans, so put "node", a new one, in place before
+ * retiring it.
+ *
+ * LOCKING PROTOCOL: caller must hold sched->mutex.
+ */
+static void skip_replace(alarm_sched_t *sched, int slot, skip_node_t *node)
+{
+    skip_node_t *old;
+
+    old = sched->store.cold[slot].node;
+    skip_insert(sched, slot, node);
+    skip_unlink(sched, old);
+}
+
+static unsigned alarm_hash_index(int alarm_id, unsigned size)
+{
+    return ((unsigned)alarm_id * 2654435761u) & (size - 1);
+}
+
+/*
+ * Find an alarm's slot by id, or -1.
+ *
+ * LOCKING PROTOCOL: caller must hold sched->mutex.
+ */
+static int alarm_find(alarm_sched_t *sched, int alarm_id)
+{
+    alarm_store_t *store = &sched->store;
+    int slot;
+
+    if (sched->hash == NULL)
+        return -1;
+    slot = sched->hash[alarm_hash_index(alarm_id, sched->hash_size)];
+    while (slot >= 0 && store->alarm_id[slot] != alarm_id)
+        slot = store->hash_link[slot];
+    return slot;
+}
+
+/*
+ * Make sure the id index has room for one more alarm, doubling the
+ * table if it is full. Returns 0 or ENOMEM.
+ *
+ * LOCKING PROTOCOL: caller must hold sched->mutex.
+ */
+static int alarm_hash_reserve(alarm_sched_t *sched)
+{
+    alarm_store_t *store = &sched->store;
+    int *table, next, move;
+    unsigned size, i, index;
+
+    if (sched->count < sched->hash_size)
+        return 0;
+    size = sched->hash_size ? sched->hash_size * 2 : ALARM_HASH_MIN;
+    table = (int *)malloc(size * sizeof(int));
+    if (table == NULL)
+        return ENOMEM;
+    for (i = 0; i < size; i++)
+        table[i] = -1;
+    for (i = 0; i < sched->hash_size; i++)
+    {
+        for (next = sched->hash[i]; next >= 0; next = move)
+        {
+            move = store->hash_link[next];
+            index = alarm_hash_index(store->alarm_id[next], size);
+            store->hash_link[next] = table[index];
+            table[index] = next;
+        }
+    }
+    free(sched->hash);
+    sched->hash = table;
+    sched->hash_size = size;
+    return 0;
+}
+
+/*
+ * Add a slot to the id index, which alarm_hash_reserve has made
+ * room in.
+ *
+ * LOCKING PROTOCOL: caller must hold sched->mutex.
+ */
+static void alarm_hash_insert(alarm_sched_t *sched, int slot)
+{
+    alarm_store_t *store = &sched->store;
+    unsigned index;
+
+    index = alarm_hash_index(store->alarm_id[slot], sched->hash_size);
+    store->hash_link[slot] = sched->hash[index];
+    sched->hash[index] = slot;
+    sched->count++;
+}
+
+/*
+ * Remove an alarm from the id index and free its slot.
+ *
+ * LOCKING PROTOCOL: caller must hold sched->mutex.
+ */
+static void alarm_remove(alarm_sched_t *sched, int slot)
+{
+    alarm_store_t *store = &sched->store;
+    int *last, status;
+
+    last = &sched->hash[alarm_hash_index(store->alarm_id[slot],
+                                         sched->hash_size)];
+    while (*last != slot)
+        last = &store->hash_link[*last];
+    *last = store->hash_link[slot];
+    sched->count--;
+    if (store->interval[slot] == 0)
+        sched->oneshots--;
+    skip_remove(sched, slot);
+    message_release(sched, store->cold[slot].message);
+    alarm_free(sched, slot);
+    if (sched->room_waiters > 0 && sched->count < sched->capacity)
+    {
+        status = pthread_cond_signal(&sched->room);
+        if (status != 0)
+            err_abort(status, "Signal room");
+    }
+}
+
+/*
+ * Wake the timer thread if it is not busy (that is, if current
+ * is 0, signifying that it's waiting for work), or if this
+ * alarm's wakeup comes before the one on which the timer thread
+ * is waiting. Inserts and changes that leave the earliest wakeup
+ * where it was do not signal at all. A virtual clock has no timer
+ * thread to wake.
+ *
+ * LOCKING PROTOCOL: caller must hold sched->mutex.
+ */
+static void alarm_kick(alarm_sched_t *sched, int slot)
+{
+    int status;
+    long long wake;
+
+    if (sched->clock == ALARM_CLOCK_VIRTUAL)
+        return;
+    wake = sched->store.cold[slot].node->wake;
+    if (sched->current == 0 || wake < sched->current)
+    {
+        sched->current = wake;
+        sched->stats.signals++;
+        status = pthread_cond_signal(&sched->cond);
+        if (status != 0)
+            err_abort(status, "Signal cond");
+    }
+    else
+        sched->stats.quiet++;
+}
+
+/*
+ * Make room for one more alarm, of "priority" and due at
+ * "expires", if the scheduler is at capacity. ALARM_LIMIT_BLOCK
+ * waits until an alarm fires or is cancelled; it can't on the
+ * timer thread, which would be waiting for itself, or on a virtual
+ * clock, which only moves when its caller moves it, and rejects
+ * instead. ALARM_LIMIT_SHED drops the alarm of lowest priority,
+ * the one due last of those, counting the new one. Returns 0, or
+ * EAGAIN if the new alarm is turned away.
+ *
+ * LOCKING PROTOCOL: caller must hold sched->mutex, which a wait
+ * releases.
+ */
+static int sched_admit(alarm_sched_t *sched, int priority, long long expires,
+                       int alarm_id)
+{
+    alarm_store_t *store = &sched->store;
+    int status, lowest, last;
+
+    if (sched->capacity == 0 || sched->count < sched->capacity)
+        return 0;
+    if (sched->policy == ALARM_LIMIT_BLOCK && sched->clock == ALARM_CLOCK_REAL
+        && timer_sched != sched)
+    {
+        sched->stats.blocked++;
+        sched->room_waiters++;
+        while (sched->capacity != 0 && sched->count >= sched->capacity
+               && !sched->stopping)
+        {
+            status = pthread_cond_wait(&sched->room, &sched->mutex);
+            if (status != 0)
+                err_abort(status, "Wait for room");
+        }
+        sched->room_waiters--;
+        return sched->stopping ? EAGAIN : 0;
+    }
+    if (sched->policy == ALARM_LIMIT_SHED)
+    {
+        for (lowest = ALARM_PRIORITY_MIN; lowest <= priority; lowest++)
+            if (sched->shed_count[lowest] > 0)
+                break;
+        if (lowest > priority)
+        {
+            sched->stats.shed++;
+            return EAGAIN;
+        }
+        last = sched->shed[lowest][0];
+        if (lowest == priority
+            && (store->expires[last] < expires
+                || (store->expires[last] == expires
+                    && store->alarm_id[last] < alarm_id)))
+        {
+            sched->stats.shed++;
+            return EAGAIN;
+        }
+        sched->stats.shed++;
+        alarm_remove(sched, last);
+        return 0;
+    }
+    sched->stats.rejected++;
+    return EAGAIN;
+}
+
+/*
+ * Make sure of room for one more alarm of "priority" in the store,
+ * the id index and the shed heap. Returns 0 or ENOMEM.
+ *
+ * LOCKING PROTOCOL: caller must hold sched->mutex.
+ */
+static int sched_reserve(alarm_sched_t *sched, int priority)
+{
+    if (alarm_reserve(sched) != 0 || alarm_hash_reserve(sched) != 0
+        || shed_reserve(sched, priority) != 0)
+        return ENOMEM;
+    return 0;
+}
+
+/*
+ * Running out of memory leaves the scheduler as it was: everything
+ * the alarm needs is taken before anything changes, and room is
+ * made again after a wait for capacity, during which other callers
+ * may have used it up. An alarm shed to make room is only dropped
+ * once there is room for its replacement.
+ *
+ * LOCKING PROTOCOL: caller must hold sched->mutex.
+ */
+static int sched_start(alarm_sched_t *sched, int alarm_id, int group_id,
+                       int seconds, int interval, long slack, int priority,
+                       const char *message, size_t length,
+                       alarm_info_t *info)
+{
+    alarm_store_t *store = &sched->store;
+    skip_node_t *node;
+    message_t *text;
+    long long expires;
+    int slot, status;
+
+    if (interval < 0 || priority < ALARM_PRIORITY_MIN
+        || priority > ALARM_PRIORITY_MAX)
+        return EINVAL;
+    if (alarm_find(sched, alarm_id) >= 0)
+        return EEXIST;
+    if (sched_reserve(sched, priority) != 0)
+        return ENOMEM;
+    node = skip_node_get(sched, skip_random_level(sched));
+    if (node == NULL)
+        return ENOMEM;
+    text = message_intern(sched, message, length);
+    if (text == NULL)
+    {
+        skip_node_put(sched, node);
+        return ENOMEM;
+    }
+    if (sched->capacity != 0 && sched->count >= sched->capacity)
+    {
+        expires = (sched_now(sched) / 1000 + seconds) * 1000;
+        status = sched_admit(sched, priority, expires, alarm_id);
+
+        /*
+         * Another caller may have started the same id while this
+         * one waited.
+         */
+        if (status == 0 && alarm_find(sched, alarm_id) >= 0)
+            status = EEXIST;
+        if (status == 0 && sched_reserve(sched, priority) != 0)
+            status = ENOMEM;
+        if (status != 0)
+        {
+            message_release(sched, text);
+            skip_node_put(sched, node);
+            return status;
+        }
+    }
+    slot = alarm_alloc(sched);
+    store->alarm_id[slot] = alarm_id;
+    store->group_id[slot] = group_id;
+    store->interval[slot] = interval;
+    store->cold[slot].seconds = seconds;
+    store->cold[slot].priority = priority;
+    store->shed_pos[slot] = -1;
+    store->cold[slot].slack = slack < 0 ? group_slack(sched, group_id) : slack;
+    store->cold[slot].message = text;
+    store->expires[slot] = (sched_now(sched) / 1000 + seconds) * 1000;
+    if (interval == 0)
+        sched->oneshots++;
+    alarm_hash_insert(sched, slot);
+    if (sched->count > sched->stats.peak)
+        sched->stats.peak = sched->count;
+    skip_insert(sched, slot, node);
+#ifdef DEBUG
+    printf("[store: %u alarms in %d slots]\n", sched->count, store->high);
+#endif
+    alarm_kick(sched, slot);
+    alarm_snapshot(sched, slot, info);
+    return 0;
+}
+
+/*
+ * The alarm is updated in place. The timer thread is woken only
+ * if the change moves the earliest wakeup earlier. If the
+ * changed alarm was the one it is waiting for and moved later,
+ * the thread wakes at the old time, finds nothing due, and waits
+ * again.
+ *
+ * LOCKING PROTOCOL: caller must hold sched->mutex.
+ */
+static int sched_change(alarm_sched_t *sched, int alarm_id, int group_id,
+                        int seconds, const char *message, size_t length,
+                        alarm_info_t *info)
+{
+    alarm_store_t *store = &sched->store;
+    skip_node_t *node;
+    message_t *text;
+    int slot;
+
+    slot = alarm_find(sched, alarm_id);
+    if (slot < 0)
+        return ENOENT;
+    if (store->interval[slot] > 0 && seconds <= 0)
+        return EINVAL;
+    node = skip_node_get(sched, skip_random_level(sched));
+    if (node == NULL)
+        return ENOMEM;
+    text = message_intern(sched, message, length);
+    if (text == NULL)
+    {
+        skip_node_put(sched, node);
+        return ENOMEM;
+    }
+    alarm_snapshot(sched, slot, info);
+    if (store->group_id[slot] != group_id)
+    {
+        store->group_id[slot] = group_id;
+        store->cold[slot].slack = group_slack(sched, group_id);
+    }
+    store->cold[slot].seconds = seconds;
+    if (store->interval[slot] > 0)
+        store->interval[slot] = seconds;
+    message_release(sched, store->cold[slot].message);
+    store->cold[slot].message = text;
+    store->expires[slot] = (sched_now(sched) / 1000 + seconds) * 1000;
+    skip_replace(sched, slot, node);
+    alarm_kick(sched, slot);
+    return 0;
+}
+
+/*
+ * Remove the alarm from the id index in constant time and free
+ * its slot. If it was the alarm the timer thread is waiting for,
+ * the thread wakes at the old time, finds nothing due and waits
+ * again.
+ *
+ * LOCKING PROTOCOL: caller must hold sched->mutex.
+ */
+static int sched_cancel(alarm_sched_t *sched, int alarm_id,
+                        alarm_info_t *info)
+{
+    int slot;
+
+    slot = alarm_find(sched, alarm_id);
+    if (slot < 0)
+        return ENOENT;
+    alarm_snapshot(sched, slot, info);
+    alarm_remove(sched, slot);
+    return 0;
+}
+
+/*
+ * Deadline queue order, for sorting a run of nodes to insert.
+ */
+static int skip_compare_time(const void *a, const void *b)
+{
+    const skip_node_t *x = *(skip_node_t *const *)a;
+    const skip_node_t *y = *(skip_node_t *const *)b;
+
+    if (x->wake != y->wake)
+        return x->wake < y->wake ? -1 : 1;
+    return (x->alarm_id > y->alarm_id) - (x->alarm_id < y->alarm_id);
+}
+
+/*
+ * The matches are found in the id index and republished there in
+ * id order, each replacement going in just ahead of its old node
+ * as for a change. The old nodes then leave the deadline queue,
+ * and the new ones join it, each as one ascending run sorted by
+ * deadline. Every search in a run starts where the last left off,
+ * so alarms close together in either order -- all of them, when
+ * they are retimed alike -- cost little more than a step apiece.
+ * The timer thread is signalled once at most. Returns the count, or
+ * -EINVAL or -ENOMEM having changed nothing.
+ *
+ * LOCKING PROTOCOL: caller must hold sched->mutex.
+ */
+static int sched_bulk(alarm_sched_t *sched, const alarm_bulk_t *bulk)
+{
+    alarm_store_t *store = &sched->store;
+    skip_node_t *update[SKIP_LEVELS], *node, **old, **new, **grow;
+    long long expires;
+    long slack;
+    int count, size, slot, i, j;
+
+    old = NULL;
+    size = 0;
+    count = 0;
+    skip_search(sched, bulk->low, update);
+    for (node = atomic_load_explicit(SKIP_BY_ID(update[0], 0), memory_order_relaxed);
+         node != NULL && node->alarm_id <= bulk->high;
+         node = atomic_load_explicit(SKIP_BY_ID(node, 0), memory_order_relaxed))
+    {
+        if (bulk->group_id != ALARM_GROUP_ANY && node->group_id != bulk->group_id)
+            continue;
+        if (bulk->seconds == 0 && node->interval > 0)
+        {
+            free(old);
+            return -EINVAL;
+        }
+        if (count == size)
+        {
+            size = size ? size * 2 : 64;
+            grow = (skip_node_t **)realloc(old, 2 * size * sizeof(skip_node_t *));
+            if (grow == NULL)
+            {
+                free(old);
+                return -ENOMEM;
+            }
+            old = grow;
+        }
+        old[count++] = node;
+    }
+    if (count == 0)
+        return 0;
+    new = old + count;
+    for (i = 0; i < count; i++)
+    {
+        new[i] = skip_node_get(sched, skip_random_level(sched));
+        if (new[i] == NULL)
+        {
+            while (--i >= 0)
+                skip_node_put(sched, new[i]);
+            free(old);
+            return -ENOMEM;
+        }
+    }
+
+    expires = (sched_now(sched) / 1000 + bulk->seconds) * 1000;
+    slack = bulk->new_group == ALARM_GROUP_ANY
+        ? 0 : group_slack(sched, bulk->new_group);
+    for (j = 0; j < SKIP_LEVELS; j++)
+        update[j] = sched->skip;
+    for (i = 0; i < count; i++)
+    {
+        slot = old[i]->slot;
+        if (bulk->new_group != ALARM_GROUP_ANY
+            && store->group_id[slot] != bulk->new_group)
+        {
+            store->group_id[slot] = bulk->new_group;
+            store->cold[slot].slack = slack;
+        }
+        if (bulk->seconds >= 0)
+        {
+            store->cold[slot].seconds = bulk->seconds;
+            if (store->interval[slot] > 0)
+                store->interval[slot] = bulk->seconds;
+            store->expires[slot] = expires;
+        }
+        skip_make(sched, slot, new[i]);
+        skip_search_from(sched, new[i]->alarm_id, update);
+        skip_link_id(new[i], update);
+        skip_cut_id(old[i], update);
+    }
+
+    qsort(old, count, sizeof(skip_node_t *), skip_compare_time);
+    for (j = 0; j < SKIP_LEVELS; j++)
+        update[j] = sched->skip;
+    for (i = 0; i < count; i++)
+    {
+        skip_search_time_from(sched, old[i]->wake, old[i]->alarm_id, update);
+        skip_cut_time(old[i], update);
+    }
+    for (i = 0; i < count; i++)
+        skip_retire(sched, old[i]);
+
+    qsort(new, count, sizeof(skip_node_t *), skip_compare_time);
+    for (j = 0; j < SKIP_LEVELS; j++)
+        update[j] = sched->skip;
+    for (i = 0; i < count; i++)
+    {
+        skip_search_time_from(sched, new[i]->wake, new[i]->alarm_id, update);
+        skip_link_time(new[i], update);
+        for (j = 0; j < new[i]->levels; j++)
+            update[j] = new[i];
+    }
+    alarm_kick(sched, new[0]->slot);
+    free(old);
+    return count;
+}
+
+/*
+ * LOCKING PROTOCOL: caller must hold sched->mutex.
+ */
+static int sched_request(alarm_sched_t *sched, const alarm_request_t *request)
+{
+    const char *message = request->message;
+    size_t length;
+
+    /*
+     * Requests may come straight from another process's memory;
+     * don't trust the message to be terminated.
+     */
+    if (request->text != NULL)
+    {
+        message = request->text;
+        length = request->length;
+    }
+    else
+        length = strnlen(message, sizeof(request->message));
+
+    switch (request->op)
+    {
+    case ALARM_OP_START:
+        return sched_start(sched, request->alarm_id, request->group_id,
+                           request->seconds, 0, request->slack,
+                           request->priority, message, length, NULL);
+    case ALARM_OP_PERIODIC:
+        if (request->seconds <= 0)
+            return EINVAL;
+        return sched_start(sched, request->alarm_id, request->group_id,
+                           request->seconds, request->seconds,
+                           request->slack, request->priority,
+                           message, length, NULL);
+    case ALARM_OP_CHANGE:
+        return sched_change(sched, request->alarm_id, request->group_id,
+                            request->seconds, message, length, NULL);
+    case ALARM_OP_CANCEL:
+        return sched_cancel(sched, request->alarm_id, NULL);
+    default:
+        return EINVAL;
+    }
+}
+
+/*
+ * Earliest wakeup point: the head of the deadline queue.
+ *
+ * LOCKING PROTOCOL: caller must hold sched->mutex.
+ */
+static long long earliest_wakeup(alarm_sched_t *sched)
+{
+    skip_node_t *first;
+
+    first = atomic_load_explicit(SKIP_BY_TIME(sched->skip, 0),
+                                 memory_order_relaxed);
+    return first == NULL ? ALARM_NEVER : first->wake;
+}
+
+/*
+ * Record a firing in the delivery buffer, growing it if needed, with
+ * "node" to reschedule a periodic alarm on. Returns 0, or ENOMEM if
+ * the buffer could not grow.
+ *
+ * LOCKING PROTOCOL: caller must hold sched->mutex.
+ */
+static int alarm_fired(alarm_sched_t *sched, int slot, int count,
+                       skip_node_t *node)
+{
+    alarm_store_t *store = &sched->store;
+    fired_t *fired;
+    int size;
+
+    if (count == sched->fired_size)
+    {
+        timer_alloc(sched);
+        size = sched->fired_size ? sched->fired_size * 2 : 64;
+        fired = (fired_t *)realloc(sched->fired, size * sizeof(fired_t));
+        if (fired == NULL)
+            return ENOMEM;
+        sched->fired = fired;
+        sched->fired_size = size;
+    }
+    fired = &sched->fired[count];
+    fired->event.type = ALARM_EVENT_FIRED;
+    fired->event.alarm_id = store->alarm_id[slot];
+    fired->event.group_id = store->group_id[slot];
+    fired->event.seconds = store->interval[slot] > 0
+        ? store->interval[slot] : store->cold[slot].seconds;
+    fired->event.time = store->expires[slot] / 1000;
+    fired->event.priority = store->cold[slot].priority;
+    fired->message = store->cold[slot].message;
+    fired->message->refs++;
+    fired->event.message = fired->message->text;
+    fired->event.length = fired->message->length;
+    fired->slot = slot;
+    fired->node = node;
+    return 0;
+}
+
+/*
+ * Firings are delivered highest priority first, and within a
+ * priority in id order, as they were when the alarms sat on a list
+ * sorted by id.
+ */
+static int fired_compare(const void *a, const void *b)
+{
+    const alarm_event_t *x = &((const fired_t *)a)->event;
+    const alarm_event_t *y = &((const fired_t *)b)->event;
+
+    if (x->priority != y->priority)
+        return y->priority - x->priority;
+    return (x->alarm_id > y->alarm_id) - (x->alarm_id < y->alarm_id);
+}
+
+/*
+ * Sift fired[i] down a heap of "count" firings, the one to be
+ * delivered last on top.
+ */
+static void fired_sift(fired_t *fired, int count, int i)
+{
+    fired_t top = fired[i];
+    int child;
+
+    while ((child = 2 * i + 1) < count)
+    {
+        if (child + 1 < count && fired_compare(&fired[child + 1], &fired[child]) > 0)
+            child++;
+        if (fired_compare(&top, &fired[child]) >= 0)
+            break;
+        fired[i] = fired[child];
+        i = child;
+    }
+    fired[i] = top;
+}
+
+/*
+ * Put a batch in delivery order. A heapsort, in place, because
+ * qsort may allocate a buffer for a large array, and this runs on
+ * the timer thread, which in real-time mode must not allocate.
+ */
+static void fired_sort(fired_t *fired, int count)
+{
+    fired_t swap;
+    int i;
+
+    for (i = count / 2 - 1; i >= 0; i--)
+        fired_sift(fired, count, i);
+    for (i = count - 1; i > 0; i--)
+    {
+        swap = fired[0];
+        fired[0] = fired[i];
+        fired[i] = swap;
+        fired_sift(fired, i, 0);
+    }
+}
+
+/*
+ * Fire the alarms at the front of the deadline queue whose
+ * deadline is at or before "now", recording each in the delivery
+ * buffer; returns how many fired. Alarms that share a deadline
+ * therefore cost one wakeup between them, not one each.
+ *
+ * The walk stops at the first alarm not yet due, as the kernel's
+ * timer queue does: an alarm that is due but queued behind it has
+ * a later wakeup point and fires by then, so it is never late,
+ * only not batched with this wakeup. Each alarm taken costs
+ * O(log n), for the unlink or the replacement, and the walk looks
+ * at no more than one alarm that is not due.
+ *
+ * One-shot alarms are removed. Periodic alarms stay and their
+ * deadline is moved on by whole intervals from the old deadline
+ * rather than from "now", so lateness in one firing does not push
+ * the later ones back. If the thread fell more than an interval
+ * behind, the missed firings are skipped, not replayed.
+ *
+ * Short of memory for the delivery buffer or a periodic alarm's
+ * next node, the drain stops there, and what it left fires on the
+ * next. "starved" is set if it could fire nothing at all.
+ *
+ * LOCKING PROTOCOL: caller must hold sched->mutex.
+ */
+static int alarm_drain(alarm_sched_t *sched, long long now)
+{
+    alarm_store_t *store = &sched->store;
+    skip_node_t *node, *next;
+    long long expires, step;
+    int slot, count, i;
+
+    count = 0;
+    sched->starved = 0;
+    node = sched->skip;
+    while ((node = atomic_load_explicit(SKIP_BY_TIME(node, 0),
+                                        memory_order_relaxed)) != NULL
+           && node->expires <= now)
+    {
+        next = NULL;
+        if (node->interval > 0)
+        {
+            next = skip_node_get(sched, skip_random_level(sched));
+            if (next == NULL)
+            {
+                sched->starved = count == 0;
+                break;
+            }
+        }
+        if (alarm_fired(sched, node->slot, count, next) != 0)
+        {
+            if (next != NULL)
+                skip_node_put(sched, next);
+            sched->starved = count == 0;
+            break;
+        }
+        count++;
+    }
+
+    for (i = 0; i < count; i++)
+    {
+        slot = sched->fired[i].slot;
+        if (store->interval[slot] > 0)
+        {
+            step = (long long)store->interval[slot] * 1000;
+            expires = store->expires[slot];
+            while (expires <= now)
+                expires += step;
+            store->expires[slot] = expires;
+            skip_replace(sched, slot, sched->fired[i].node);
+            continue;
+        }
+        alarm_remove(sched, slot);
+    }
+    if (count > 1)
+        fired_sort(sched->fired, count);
+    return count;
+}
+
+/*
+ * Deliver the "fired" firings in the delivery buffer, then the
+ * batch's flush. The delivery buffer belongs to whichever thread
+ * drained it, so the callbacks run without the mutex; they may
+ * call back into the scheduler.
+ *
+ * LOCKING PROTOCOL: caller must hold sched->mutex, which is
+ * released during the callbacks and held again on return.
+ */
+static void alarm_deliver(alarm_sched_t *sched, int fired)
+{
+    alarm_event_t flush;
+    int status, i;
+
+    status = pthread_mutex_unlock(&sched->mutex);
+    if (status != 0)
+        err_abort(status, "Unlock mutex");
+    for (i = 0; i < fired; i++)
+        sched->callback(&sched->fired[i].event, sched->arg);
+    memset(&flush, 0, sizeof(flush));
+    flush.type = ALARM_EVENT_FLUSH;
+    sched->callback(&flush, sched->arg);
+    status = pthread_mutex_lock(&sched->mutex);
+    if (status != 0)
+        err_abort(status, "Lock mutex");
+    for (i = 0; i < fired; i++)
+        if (sched->fired[i].message != NULL)
+            message_release(sched, sched->fired[i].message);
+}
+
+/*
+ * The timer thread's start routine.
+ */
+static void *alarm_thread(void *arg)
+{
+    alarm_sched_t *sched = (alarm_sched_t *)arg;
+    struct timespec cond_time;
+    long long wake;
+    int status, timedout, fired;
+
+    timer_sched = sched;
+
+    /*
+     * Loop until the scheduler is destroyed. Lock the mutex at
+     * the start -- it will be unlocked during condition waits, so
+     * callers can insert alarms.
+     */
+    status = pthread_mutex_lock(&sched->mutex);
+    if (status != 0)
+        err_abort(status, "Lock mutex");
+    while (!sched->stopping)
+    {
+        /*
+         * If the store is empty, wait until an alarm is added.
+         * Setting current to 0 informs the insert routine that
+         * the thread is not busy.
+         */
+        sched->current = 0;
+        while (sched->count == 0 && !sched->stopping)
+        {
+            status = pthread_cond_wait(&sched->cond, &sched->mutex);
+            if (status != 0)
+                err_abort(status, "Wait on cond");
+            if (sched->count == 0)
+                sched->stats.spurious++;
+            else
+                sched->stats.necessary++;
+        }
+        if (sched->stopping)
+            break;
+
+        /*
+         * Sleep until the earliest wakeup point, or until an
+         * insert moves current earlier. Either way, fall through
+         * to the drain: it fires whatever is due and the loop
+         * recomputes the next wakeup.
+         */
+        wake = earliest_wakeup(sched);
+        sched->current = wake;
+        timedout = 0;
+        if (wake > now_msec())
+        {
+#ifdef DEBUG
+            printf("[waiting: %lld(%lld)]\n", wake, wake - now_msec());
+#endif
+            cond_time.tv_sec = wake / 1000;
+            cond_time.tv_nsec = (wake % 1000) * 1000000;
+            while (sched->current == wake && !sched->stopping)
+            {
+                status = pthread_cond_timedwait(
+                    &sched->cond, &sched->mutex, &cond_time);
+                if (status == ETIMEDOUT)
+                {
+                    timedout = 1;
+                    break;
+                }
+                if (status != 0)
+                    err_abort(status, "Cond timedwait");
+                if (sched->current == wake)
+                    sched->stats.spurious++;
+                else
+                    sched->stats.necessary++;
+            }
+        }
+
+        fired = alarm_drain(sched, now_msec());
+
+        /*
+         * A timeout with nothing due means the alarm we slept for
+         * was changed to a later time without waking us.
+         */
+        if (timedout)
+        {
+            if (fired == 0)
+                sched->stats.spurious++;
+            else
+                sched->stats.necessary++;
+        }
+        if (fired == 0 && sched->starved)
+        {
+            /*
+             * Nothing could fire for want of memory: try again
+             * shortly rather than spin on the mutex.
+             */
+            wake = now_msec() + ALARM_RETRY;
+            cond_time.tv_sec = wake / 1000;
+            cond_time.tv_nsec = (wake % 1000) * 1000000;
+            status = pthread_cond_timedwait(&sched->cond, &sched->mutex, &cond_time);
+            if (status != 0 && status != ETIMEDOUT)
+                err_abort(status, "Cond timedwait");
+        }
+        if (fired == 0)
+            continue;
+        alarm_deliver(sched, fired);
+    }
+    status = pthread_mutex_unlock(&sched->mutex);
+    if (status != 0)
+        err_abort(status, "Unlock mutex");
+    return NULL;
+}
+
+alarm_sched_t *alarm_sched_create(alarm_callback_t callback, void *arg,
+                                  long slack)
+{
+    return alarm_sched_create_clock(callback, arg, slack, ALARM_CLOCK_REAL, 0);
+}
+
+/*
+ * Free what sched_create allocated for a scheduler that never
+ * started.
+ */
+static void sched_discard(alarm_sched_t *sched)
+{
+    sched->reserve = 0;
+    sched_refill(sched);
+    free(sched->fired);
+    free(sched->skip);
+    free(sched);
+}
+
+/*
+ * Create a scheduler; "realtime", if not NULL, asks for the timer
+ * thread to run under SCHED_FIFO with its allocations reserved.
+ */
+static alarm_sched_t *sched_create(alarm_callback_t callback, void *arg,
+                                   long slack, int clock, long long start,
+                                   const alarm_realtime_t *realtime)
+{
+    alarm_sched_t *sched;
+    pthread_mutexattr_t mutex_attr;
+    pthread_attr_t attr;
+    struct sched_param param;
+    int status;
+
+    if (clock != ALARM_CLOCK_REAL && clock != ALARM_CLOCK_VIRTUAL)
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+    sched = (alarm_sched_t *)calloc(1, sizeof(alarm_sched_t));
+    if (sched == NULL)
+        return NULL;
+    sched->callback = callback;
+    sched->arg = arg;
+    sched->slack = slack < 0 ? 0 : slack;
+    sched->clock = clock;
+    sched->clock_now = start;
+    sched->skip = skip_node_alloc(SKIP_LEVELS);
+    sched->skip_seed = 2463534242u;
+    sched->limbo_limit = SKIP_LIMBO;
+    atomic_init(&sched->epoch, 1);
+    if (realtime != NULL)
+    {
+        sched->reserve = realtime->reserve > 0 ? realtime->reserve : 1;
+        sched->fired_size = sched->reserve;
+        sched->fired = (fired_t *)malloc(sched->fired_size * sizeof(fired_t));
+        sched_refill(sched);
+    }
+    if (sched->skip == NULL || (realtime != NULL && sched->fired == NULL)
+        || sched->pool_count < sched->reserve)
+    {
+        sched_discard(sched);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    /*
+     * In real-time mode the mutex inherits priority, so that a
+     * writer holding it when the timer thread wants it runs at
+     * the timer thread's priority until it lets go.
+     */
+    status = pthread_mutexattr_init(&mutex_attr);
+    if (status != 0)
+        err_abort(status, "Init mutex attr");
+    if (realtime != NULL)
+    {
+        status = pthread_mutexattr_setprotocol(&mutex_attr, PTHREAD_PRIO_INHERIT);
+        if (status != 0)
+            err_abort(status, "Set mutex protocol");
+    }
+    status = pthread_mutex_init(&sched->mutex, &mutex_attr);
+    if (status != 0)
+        err_abort(status, "Init mutex");
+    pthread_mutexattr_destroy(&mutex_attr);
+    status = pthread_cond_init(&sched->cond, NULL);
+    if (status != 0)
+        err_abort(status, "Init cond");
+    status = pthread_cond_init(&sched->room, NULL);
+    if (status != 0)
+        err_abort(status, "Init cond");
+    if (clock == ALARM_CLOCK_VIRTUAL)
+        return sched;
+
+    status = pthread_attr_init(&attr);
+    if (status != 0)
+        err_abort(status, "Init thread attr");
+    if (realtime != NULL)
+    {
+        param.sched_priority = realtime->priority;
+        status = pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+        if (status == 0)
+            status = pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
+        if (status == 0)
+            status = pthread_attr_setschedparam(&attr, &param);
+    }
+    if (status == 0)
+        status = pthread_create(&sched->thread, &attr, alarm_thread, sched);
+    pthread_attr_destroy(&attr);
+    if (status != 0)
+    {
+        pthread_cond_destroy(&sched->room);
+        pthread_cond_destroy(&sched->cond);
+        pthread_mutex_destroy(&sched->mutex);
+        sched_discard(sched);
+        errno = status;
+        return NULL;
+    }
+    return sched;
+}
+
+alarm_sched_t *alarm_sched_create_clock(alarm_callback_t callback, void *arg,
+                                        long slack, int clock, long long start)
+{
+    return sched_create(callback, arg, slack, clock, start, NULL);
+}
+
+alarm_sched_t *alarm_sched_create_realtime(alarm_callback_t callback,
+                                           void *arg, long slack,
+                                           const alarm_realtime_t *realtime)
+{
+    return sched_create(callback, arg, slack, ALARM_CLOCK_REAL, 0, realtime);
+}
+
+int alarm_sched_affinity(alarm_sched_t *sched, size_t setsize,
+                         const cpu_set_t *cpus)
+{
+    if (sched->clock != ALARM_CLOCK_REAL)
+        return EINVAL;
+    return pthread_setaffinity_np(sched->thread, setsize, cpus);
+}
+
+static void sched_lock(alarm_sched_t *sched)
+{
+    int status;
+
+    status = pthread_mutex_lock(&sched->mutex);
+    if (status != 0)
+        err_abort(status, "Lock mutex");
+}
+
+static void sched_unlock(alarm_sched_t *sched)
+{
+    int status;
+
+    if (sched->reserve > 0 && timer_sched != sched)
+        sched_refill(sched);
+    status = pthread_mutex_unlock(&sched->mutex);
+    if (status != 0)
+        err_abort(status, "Unlock mutex");
+}
+
+int alarm_sched_start(alarm_sched_t *sched, int alarm_id, int group_id,
+                      int seconds, int interval, long slack,
+                      const char *message, alarm_info_t *info)
+{
+    return alarm_sched_start_priority(sched, alarm_id, group_id, seconds,
+                                      interval, slack, ALARM_PRIORITY_MIN,
+                                      message, info);
+}
+
+int alarm_sched_start_priority(alarm_sched_t *sched, int alarm_id,
+                               int group_id, int seconds, int interval,
+                               long slack, int priority, const char *message,
+                               alarm_info_t *info)
+{
+    return alarm_sched_start_text(sched, alarm_id, group_id, seconds,
+                                  interval, slack, priority, message,
+                                  strlen(message), info);
+}
+
+int alarm_sched_start_text(alarm_sched_t *sched, int alarm_id, int group_id,
+                           int seconds, int interval, long slack,
+                           int priority, const char *text, size_t length,
+                           alarm_info_t *info)
+{
+    int status;
+
+    if (info != NULL)
+        info->message = NULL;
+    sched_lock(sched);
+    status = sched_start(sched, alarm_id, group_id, seconds, interval,
+                         slack, priority, text, length, info);
+    sched_unlock(sched);
+    return status;
+}
+
+int alarm_sched_change(alarm_sched_t *sched, int alarm_id, int group_id,
+                       int seconds, const char *message, alarm_info_t *info)
+{
+    return alarm_sched_change_text(sched, alarm_id, group_id, seconds,
+                                   message, strlen(message), info);
+}
+
+int alarm_sched_change_text(alarm_sched_t *sched, int alarm_id, int group_id,
+                            int seconds, const char *text, size_t length,
+                            alarm_info_t *info)
+{
+    int status;
+
+    if (info != NULL)
+        info->message = NULL;
+    sched_lock(sched);
+    status = sched_change(sched, alarm_id, group_id, seconds, text,
+                          length, info);
+    sched_unlock(sched);
+    return status;
+}
+
+int alarm_sched_cancel(alarm_sched_t *sched, int alarm_id, alarm_info_t *info)
+{
+    int status;
+
+    if (info != NULL)
+        info->message = NULL;
+    sched_lock(sched);
+    status = sched_cancel(sched, alarm_id, info);
+    sched_unlock(sched);
+    return status;
+}
+
+void alarm_sched_submit(alarm_sched_t *sched, const alarm_request_t *requests,
+                        int count, int *status)
+{
+    int i, result;
+
+    sched_lock(sched);
+    for (i = 0; i < count; i++)
+    {
+        result = sched_request(sched, &requests[i]);
+        if (status != NULL)
+            status[i] = result;
+    }
+    sched_unlock(sched);
+}
+
+int alarm_sched_bulk(alarm_sched_t *sched, const alarm_bulk_t *bulk)
+{
+    int count;
+
+    sched_lock(sched);
+    count = sched_bulk(sched, bulk);
+    sched_unlock(sched);
+    if (count < 0)
+    {
+        errno = -count;
+        count = -1;
+    }
+    return count;
+}
+
+/*
+ * Set the slack for a group, adding it to the group list if this
+ * is the first setting for it. Only alarms started afterwards
+ * pick the new value up.
+ */
+int alarm_sched_group_slack(alarm_sched_t *sched, int group_id, long slack)
+{
+    group_t *group;
+
+    sched_lock(sched);
+    for (group = sched->groups; group != NULL; group = group->link)
+        if (group->group_id == group_id)
+            break;
+    if (group == NULL)
+    {
+        group = (group_t *)malloc(sizeof(group_t));
+        if (group == NULL)
+        {
+            sched_unlock(sched);
+            return ENOMEM;
+        }
+        group->group_id = group_id;
+        group->link = sched->groups;
+        sched->groups = group;
+    }
+    group->slack = slack < 0 ? 0 : slack;
+    sched_unlock(sched);
+    return 0;
+}
+
+void alarm_sched_stats(alarm_sched_t *sched, alarm_stats_t *stats)
+{
+    sched_lock(sched);
+    *stats = sched->stats;
+    stats->pending = sched->count;
+    stats->capacity = sched->capacity;
+    stats->waiting = sched->room_waiters;
+    sched_unlock(sched);
+}
+
+/*
+ * Raising or lifting the limit lets every waiting start retry.
+ */
+int alarm_sched_limit(alarm_sched_t *sched, unsigned capacity, int policy)
+{
+    int status;
+
+    if (policy != ALARM_LIMIT_REJECT && policy != ALARM_LIMIT_BLOCK
+        && policy != ALARM_LIMIT_SHED)
+        return EINVAL;
+    sched_lock(sched);
+    sched->capacity = capacity;
+    sched->policy = policy;
+    if (sched->room_waiters > 0)
+    {
+        status = pthread_cond_broadcast(&sched->room);
+        if (status != 0)
+            err_abort(status, "Broadcast room");
+    }
+    sched_unlock(sched);
+    return 0;
+}
+
+/*
+ * Take a reader slot, announcing the epoch the scan starts in. The
+ * epoch is read again after the announcement; if an unlink moved
+ * it on in between, a collection may not have seen the slot, so
+ * announce the newer epoch instead.
+ */
+static int skip_enter(alarm_sched_t *sched)
+{
+    unsigned long epoch, idle, again;
+    int i;
+
+    for (i = 0; ; i = (i + 1) % SKIP_READERS)
+    {
+        idle = 0;
+        epoch = atomic_load(&sched->epoch);
+        if (atomic_compare_exchange_strong(&sched->readers[i], &idle, epoch))
+            break;
+        if (i == SKIP_READERS - 1)
+            sched_yield();
+    }
+    while ((again = atomic_load(&sched->epoch)) != epoch)
+    {
+        atomic_store(&sched->readers[i], again);
+        epoch = again;
+    }
+    return i;
+}
+
+/*
+ * What a scan reports of a node.
+ */
+static void skip_info(const skip_node_t *node, alarm_info_t *info)
+{
+    info->alarm_id = node->alarm_id;
+    info->group_id = node->group_id;
+    info->seconds = node->seconds;
+    info->interval = node->interval;
+    info->priority = node->priority;
+    info->slack = node->slack;
+    info->time = node->expires / 1000;
+    info->message = node->message->text;
+    info->length = node->message->length;
+}
+
+int alarm_sched_range(alarm_sched_t *sched, int low, int high,
+                      alarm_visit_t visit, void *arg)
+{
+    skip_node_t *node, *next;
+    alarm_info_t info;
+    int reader, i, count, last;
+
+    reader = skip_enter(sched);
+    node = sched->skip;
+    for (i = SKIP_LEVELS - 1; i >= 0; i--)
+    {
+        while ((next = atomic_load_explicit(SKIP_BY_ID(node, i),
+                                            memory_order_acquire)) != NULL
+               && next->alarm_id < low)
+            node = next;
+    }
+    count = 0;
+    last = 0;
+    for (node = atomic_load_explicit(SKIP_BY_ID(node, 0), memory_order_acquire);
+         node != NULL && node->alarm_id <= high;
+         node = atomic_load_explicit(SKIP_BY_ID(node, 0), memory_order_acquire))
+    {
+        if (count > 0 && node->alarm_id == last)
+            continue;
+        skip_info(node, &info);
+        visit(&info, arg);
+        last = node->alarm_id;
+        count++;
+    }
+    atomic_store(&sched->readers[reader], 0);
+    return count;
+}
+
+/*
+ * As alarm_sched_range, but down the deadline queue: descend to
+ * the first wakeup at or after "from", then walk the bottom level
+ * until "to". Alarms of other groups are passed over, not
+ * reported.
+ */
+int alarm_sched_window(alarm_sched_t *sched, long long from, long long to,
+                       int group_id, alarm_visit_t visit, void *arg)
+{
+    skip_node_t *node, *next;
+    alarm_info_t info;
+    int reader, i, count;
+
+    reader = skip_enter(sched);
+    node = sched->skip;
+    for (i = SKIP_LEVELS - 1; i >= 0; i--)
+    {
+        while ((next = atomic_load_explicit(SKIP_BY_TIME(node, i),
+                                            memory_order_acquire)) != NULL
+               && next->wake < from)
+            node = next;
+    }
+    count = 0;
+    for (node = atomic_load_explicit(SKIP_BY_TIME(node, 0), memory_order_acquire);
+         node != NULL && node->wake <= to;
+         node = atomic_load_explicit(SKIP_BY_TIME(node, 0), memory_order_acquire))
+    {
+        if (group_id != ALARM_GROUP_ANY && node->group_id != group_id)
+            continue;
+        skip_info(node, &info);
+        visit(&info, arg);
+        count++;
+    }
+    atomic_store(&sched->readers[reader], 0);
+    return count;
+}
+
+void alarm_sched_info_release(alarm_sched_t *sched, alarm_info_t *info)
+{
+    if (info->message == NULL)
+        return;
+    sched_lock(sched);
+    message_release(sched, (message_t *)(info->message - offsetof(message_t, text)));
+    sched_unlock(sched);
+    info->message = NULL;
+}
+
+void alarm_sched_message_keep(alarm_sched_t *sched, const alarm_event_t *event)
+{
+    fired_t *fired = (fired_t *)event;
+
+    (void)sched;
+    fired->message = NULL;
+}
+
+void alarm_sched_message_release(alarm_sched_t *sched,
+                                 const char **messages, int count)
+{
+    int i;
+
+    if (count == 0)
+        return;
+    sched_lock(sched);
+    for (i = 0; i < count; i++)
+        message_release(sched, (message_t *)(messages[i] - offsetof(message_t, text)));
+    sched_unlock(sched);
+}
+
+long long alarm_sched_now(alarm_sched_t *sched)
+{
+    long long now;
+
+    sched_lock(sched);
+    now = sched_now(sched);
+    sched_unlock(sched);
+    return now;
+}
+
+/*
+ * The virtual clock's equivalent of the timer thread: jump to the
+ * earliest wakeup, fire and deliver what is due there, and repeat
+ * until the next wakeup lies beyond "until". Callbacks may start
+ * new alarms; they are found by the next pass. Short of memory, it
+ * stops where it got to.
+ */
+long alarm_sched_advance(alarm_sched_t *sched, long long until)
+{
+    long long wake;
+    long total;
+    int fired;
+
+    if (sched->clock != ALARM_CLOCK_VIRTUAL)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    total = 0;
+    sched_lock(sched);
+    while (1)
+    {
+        if (until == ALARM_CLOCK_DRAIN && sched->oneshots == 0)
+            break;
+        wake = earliest_wakeup(sched);
+        if (until != ALARM_CLOCK_DRAIN && wake > until)
+            break;
+        if (wake > sched->clock_now)
+            sched->clock_now = wake;
+        fired = alarm_drain(sched, sched->clock_now);
+        if (sched->starved)
+        {
+            sched_unlock(sched);
+            errno = ENOMEM;
+            return -1;
+        }
+        sched->stats.necessary++;
+        total += fired;
+        alarm_deliver(sched, fired);
+    }
+    if (until > sched->clock_now)
+        sched->clock_now = until;
+    sched_unlock(sched);
+    return total;
+}
+
+void alarm_sched_destroy(alarm_sched_t *sched)
+{
+    alarm_store_t *store = &sched->store;
+    message_chunk_t *chunk;
+    message_t *message, *link;
+    skip_node_t *node;
+    group_t *group;
+    unsigned i;
+    int status;
+
+    if (sched->clock == ALARM_CLOCK_REAL)
+    {
+        sched_lock(sched);
+        sched->stopping = 1;
+        status = pthread_cond_signal(&sched->cond);
+        if (status != 0)
+            err_abort(status, "Signal cond");
+        status = pthread_cond_broadcast(&sched->room);
+        if (status != 0)
+            err_abort(status, "Broadcast room");
+        sched_unlock(sched);
+        status = pthread_join(sched->thread, NULL);
+        if (status != 0)
+            err_abort(status, "Join timer thread");
+    }
+
+    /*
+     * Arena entries go with their chunks; only the messages
+     * malloc'd on their own are freed one by one.
+     */
+    for (i = 0; i < sched->message_size; i++)
+    {
+        for (message = sched->messages[i]; message != NULL; message = link)
+        {
+            link = message->link;
+            if (message->size_class < 0)
+                free(message);
+        }
+    }
+    free(sched->messages);
+    while ((chunk = sched->chunks) != NULL)
+    {
+        sched->chunks = chunk->link;
+        free(chunk);
+    }
+
+    free(store->expires);
+    free(store->alarm_id);
+    free(store->group_id);
+    free(store->interval);
+    free(store->cold);
+    free(store->hash_link);
+    free(store->shed_pos);
+    free(store->free);
+    for (i = 0; i < ALARM_PRIORITIES; i++)
+        free(sched->shed[i]);
+    while ((group = sched->groups) != NULL)
+    {
+        sched->groups = group->link;
+        free(group);
+    }
+    while (sched->skip != NULL)
+    {
+        node = sched->skip;
+        sched->skip = atomic_load(SKIP_BY_ID(node, 0));
+        free(node);
+    }
+    while ((node = sched->limbo) != NULL)
+    {
+        sched->limbo = node->limbo;
+        free(node);
+    }
+    sched->reserve = 0;
+    sched_refill(sched);
+    free(sched->hash);
+    free(sched->fired);
+    pthread_cond_destroy(&sched->room);
+    pthread_cond_destroy(&sched->cond);
+    pthread_mutex_destroy(&sched->mutex);
+    free(sched);
+}
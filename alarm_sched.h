@@ -0,0 +1,417 @@
+#ifndef __alarm_sched_h
+#define __alarm_sched_h
+
+/*
+ * alarm_sched.h
+ *
+ * The alarm scheduler as a library (libalarm). A scheduler owns
+ * its alarms, its locks and the timer thread that fires them;
+ * there is no global state, so a process may run as many
+ * schedulers as it likes. Fired alarms are delivered by calling
+ * the callback given to alarm_sched_create, on the timer thread,
+ * with no scheduler lock held -- the callback may start, change
+ * or cancel alarms itself.
+ *
+ * Every call that can fail returns 0 or an error number, the way
+ * the pthread functions do:
+ *
+ *      EEXIST  alarm_sched_start: an alarm with that id exists
+ *      EAGAIN  alarm_sched_start: no room under the limit set with
+ *              alarm_sched_limit
+ *      ENOENT  alarm_sched_change/_cancel: no alarm with that id
+ *      EINVAL  a malformed request
+ *      ENOMEM  out of memory; the request changed nothing
+ *
+ * Running out of memory never ends the process: what to do then is
+ * the caller's decision. A timer thread short of memory
+ * fires what it can and tries the rest again shortly.
+ *
+ * Build with "make -f make libalarm.a" or "make -f make
+ * libalarm.so" and link with -lpthread.
+ */
+#include <stddef.h>
+#include <sched.h>
+#include <time.h>
+
+typedef struct alarm_sched alarm_sched_t;
+
+/*
+ * Priorities an alarm may have; higher is more urgent. Alarms that
+ * fire together are delivered highest priority first.
+ */
+#define ALARM_PRIORITY_MIN 0
+#define ALARM_PRIORITY_MAX 7
+#define ALARM_PRIORITIES   (ALARM_PRIORITY_MAX + 1)
+
+/*
+ * What a callback is told about a fired alarm. Alarms that fire
+ * at one wakeup are delivered as a batch: one ALARM_EVENT_FIRED
+ * per alarm, highest priority first and then in id order, then
+ * one ALARM_EVENT_FLUSH with no alarm. "message"
+ * points into scheduler storage and stays valid until the
+ * callback returns from the batch's ALARM_EVENT_FLUSH, so a
+ * callback may queue the text and write the whole batch out at
+ * once without copying it; alarm_sched_message_keep keeps it for
+ * longer. Messages may be any length; "length" excludes the
+ * terminating NUL.
+ */
+#define ALARM_EVENT_FIRED 1
+#define ALARM_EVENT_FLUSH 2
+
+typedef struct alarm_event_tag
+{
+    int type;           /* ALARM_EVENT_* */
+    int alarm_id;
+    int group_id;
+    int seconds;        /* requested seconds, or the interval */
+    time_t time;        /* the deadline that fired, seconds from EPOCH */
+    int priority;       /* ALARM_PRIORITY_MIN to _MAX */
+    const char *message;
+    size_t length;
+} alarm_event_t;
+
+typedef void (*alarm_callback_t)(const alarm_event_t *event, void *arg);
+
+/*
+ * A snapshot of one alarm, filled in by start, change and cancel
+ * when the caller passes somewhere to put it. "message" holds a
+ * reference to the scheduler's copy of the text, which stays
+ * valid until the caller drops it with alarm_sched_info_release.
+ */
+typedef struct alarm_info_tag
+{
+    int alarm_id;
+    int group_id;
+    int seconds;
+    int interval;       /* 0 for a one-shot alarm */
+    int priority;
+    long slack;         /* msec */
+    time_t time;        /* deadline, seconds from EPOCH */
+    const char *message;
+    size_t length;
+} alarm_info_t;
+
+/*
+ * One request for alarm_sched_submit, which applies a batch of
+ * them under a single hold of the scheduler lock. The message is
+ * "message", or, if "text" is not NULL, the "length" bytes at
+ * "text" -- for callers in the same process with messages of any
+ * length; the scheduler copies them before submit returns.
+ */
+#define ALARM_OP_START    1     /* seconds from now, once */
+#define ALARM_OP_PERIODIC 2     /* every "seconds" until cancelled */
+#define ALARM_OP_CHANGE   3
+#define ALARM_OP_CANCEL   4
+
+#define ALARM_REQUEST_MESSAGE 64  /* bytes; need not be NUL-terminated */
+
+typedef struct alarm_request_tag
+{
+    int op;             /* ALARM_OP_* */
+    int alarm_id;
+    int group_id;
+    int seconds;
+    long slack;         /* msec; -1 takes the group's */
+    int priority;       /* start, periodic: ALARM_PRIORITY_* */
+    char message[ALARM_REQUEST_MESSAGE];
+    const char *text;   /* NULL to use "message" */
+    size_t length;      /* bytes at "text" */
+} alarm_request_t;
+
+/*
+ * Wakeup accounting. A wakeup is necessary if it fired alarms or
+ * found that an insert had moved the earliest deadline;
+ * otherwise it is spurious.
+ */
+typedef struct alarm_stats_tag
+{
+    unsigned long signals;    /* inserts/changes that woke the timer thread */
+    unsigned long quiet;      /* inserts/changes that left it asleep */
+    unsigned long necessary;  /* wakeups that had work to do */
+    unsigned long spurious;   /* wakeups that found nothing to do */
+    unsigned long timer_allocs;  /* malloc calls made on the timer thread */
+
+    /*
+     * Depth, and what the limit set with alarm_sched_limit did.
+     */
+    unsigned pending;         /* alarms set now */
+    unsigned peak;            /* most ever set at once */
+    unsigned capacity;        /* the limit; 0 for none */
+    unsigned waiting;         /* starts waiting for room now */
+    unsigned long rejected;   /* starts refused with EAGAIN */
+    unsigned long blocked;    /* starts that had to wait for room */
+    unsigned long shed;       /* alarms dropped to make room, new or old */
+} alarm_stats_t;
+
+/*
+ * Create a scheduler and start its timer thread. "slack" is the
+ * default slack in msec for groups without their own. Returns
+ * NULL, with errno set (ENOMEM, or the error from pthread_create),
+ * on failure.
+ */
+extern alarm_sched_t *alarm_sched_create(alarm_callback_t callback,
+                                         void *arg, long slack);
+
+/*
+ * Clocks a scheduler can run on. ALARM_CLOCK_REAL is the wall
+ * clock, with a timer thread that sleeps until each wakeup, as
+ * alarm_sched_create gives. ALARM_CLOCK_VIRTUAL is simulated time:
+ * there is no timer thread, and time stands still until the
+ * caller moves it on with alarm_sched_advance, which skips
+ * straight from one wakeup to the next. A day's schedule then runs
+ * in as long as its callbacks take, and the same calls always fire
+ * the same alarms in the same order.
+ */
+#define ALARM_CLOCK_REAL    0
+#define ALARM_CLOCK_VIRTUAL 1
+
+/*
+ * alarm_sched_create with a choice of clock. A virtual clock
+ * starts at "start", msec from EPOCH; a real one ignores it.
+ */
+extern alarm_sched_t *alarm_sched_create_clock(alarm_callback_t callback,
+                                               void *arg, long slack,
+                                               int clock, long long start);
+
+/*
+ * Real-time mode, for groups with tight deadlines: the timer
+ * thread runs under SCHED_FIFO at "priority", and the scheduler's
+ * mutex inherits priority. Index nodes and the delivery buffer
+ * are allocated ahead for "reserve" firings, and callers starting
+ * and changing alarms top the reserve up again, so the timer thread
+ * itself calls malloc only if more than "reserve" alarms fire
+ * between two such calls. alarm_stats_t.timer_allocs counts the
+ * times it did.
+ *
+ * Locking the process's memory (mlockall) and keeping the callback
+ * free of allocation and blocking I/O are the caller's part.
+ */
+typedef struct alarm_realtime_tag
+{
+    int priority;       /* SCHED_FIFO priority, 1 to 99 */
+    int reserve;        /* firings to allocate for ahead */
+} alarm_realtime_t;
+
+/*
+ * alarm_sched_create in real-time mode, on the real clock. Fails
+ * with EPERM if the process may not use SCHED_FIFO.
+ */
+extern alarm_sched_t *alarm_sched_create_realtime(alarm_callback_t callback,
+                                                  void *arg, long slack,
+                                                  const alarm_realtime_t *realtime);
+
+/*
+ * The scheduler's time, msec from EPOCH.
+ */
+extern long long alarm_sched_now(alarm_sched_t *sched);
+
+/*
+ * Move a virtual clock on to "until", msec from EPOCH, stopping at
+ * each wakeup on the way to fire what is due and deliver it on the
+ * calling thread. ALARM_CLOCK_DRAIN runs until no one-shot alarm
+ * is left; periodic alarms fire along the way and stay pending.
+ * Returns the number of alarms fired, or -1 with errno EINVAL on a
+ * real clock, or ENOMEM if it ran out of memory on the way, leaving
+ * the clock where it stopped. Only one thread may advance a
+ * scheduler at a time,
+ * and never from inside its callback.
+ */
+#define ALARM_CLOCK_DRAIN (-1LL)
+
+extern long alarm_sched_advance(alarm_sched_t *sched, long long until);
+
+/*
+ * Start an alarm "seconds" from now. "interval" > 0 makes it
+ * periodic: it fires every "interval" seconds, rescheduled from
+ * its previous deadline, until cancelled. "slack" < 0 takes the
+ * group's slack. The scheduler keeps its own copy of "message";
+ * alarms with identical messages share one.
+ */
+extern int alarm_sched_start(alarm_sched_t *sched, int alarm_id,
+                             int group_id, int seconds, int interval,
+                             long slack, const char *message,
+                             alarm_info_t *info);
+
+/*
+ * alarm_sched_start with a priority, from ALARM_PRIORITY_MIN (what
+ * alarm_sched_start gives) to ALARM_PRIORITY_MAX; EINVAL outside
+ * it. An alarm keeps its priority through changes.
+ */
+extern int alarm_sched_start_priority(alarm_sched_t *sched, int alarm_id,
+                                      int group_id, int seconds,
+                                      int interval, long slack,
+                                      int priority, const char *message,
+                                      alarm_info_t *info);
+
+/*
+ * Move an alarm to "group_id", due "seconds" from now, with a
+ * new message. A periodic alarm takes "seconds" as its new
+ * interval. "info", if not NULL, receives the alarm as it was
+ * before the change.
+ */
+extern int alarm_sched_change(alarm_sched_t *sched, int alarm_id,
+                              int group_id, int seconds,
+                              const char *message, alarm_info_t *info);
+
+/*
+ * alarm_sched_start_priority and alarm_sched_change with the
+ * message given as the "length" bytes at "text", which need not
+ * be NUL-terminated -- for a message that lies in a line being
+ * parsed, perhaps in read-only memory.
+ */
+extern int alarm_sched_start_text(alarm_sched_t *sched, int alarm_id,
+                                  int group_id, int seconds, int interval,
+                                  long slack, int priority,
+                                  const char *text, size_t length,
+                                  alarm_info_t *info);
+extern int alarm_sched_change_text(alarm_sched_t *sched, int alarm_id,
+                                   int group_id, int seconds,
+                                   const char *text, size_t length,
+                                   alarm_info_t *info);
+
+/*
+ * Remove an alarm. "info", if not NULL, receives the alarm as it
+ * was.
+ */
+extern int alarm_sched_cancel(alarm_sched_t *sched, int alarm_id,
+                              alarm_info_t *info);
+
+/*
+ * Apply "count" requests in order under one hold of the lock --
+ * unless a start has to wait for room under ALARM_LIMIT_BLOCK,
+ * which lets other callers in. "status", if not NULL, receives
+ * each request's result.
+ */
+extern void alarm_sched_submit(alarm_sched_t *sched,
+                               const alarm_request_t *requests, int count,
+                               int *status);
+
+/*
+ * A change to many alarms at once, for alarm_sched_bulk: every
+ * alarm with an id from "low" to "high" in group "group_id" -- or
+ * in any group, for ALARM_GROUP_ANY -- moves to "new_group", or
+ * keeps its group for ALARM_GROUP_ANY, and, unless "seconds" is
+ * negative, is set to fire "seconds" from now, as
+ * alarm_sched_change would set it. Messages are kept.
+ */
+#define ALARM_GROUP_ANY (-1)
+
+typedef struct alarm_bulk_tag
+{
+    int low, high;
+    int group_id;
+    int new_group;
+    int seconds;
+} alarm_bulk_t;
+
+/*
+ * Apply a bulk change under one hold of the scheduler lock, so no
+ * other call sees it half done (scans, which take no lock, may),
+ * and return how many alarms it changed. There is no event or
+ * report per alarm: the count is the summary. Fails with -1 and
+ * errno EINVAL, changing nothing, if "seconds" is 0 and a periodic
+ * alarm matches, or ENOMEM.
+ */
+extern int alarm_sched_bulk(alarm_sched_t *sched, const alarm_bulk_t *bulk);
+
+/*
+ * Set the slack, in msec, of alarms started in "group_id" from
+ * now on. Returns 0 or ENOMEM.
+ */
+extern int alarm_sched_group_slack(alarm_sched_t *sched, int group_id,
+                                    long slack);
+
+extern void alarm_sched_stats(alarm_sched_t *sched, alarm_stats_t *stats);
+
+/*
+ * Admission control: allow at most "capacity" alarms to be set at
+ * once (0, the default, for no limit). A start beyond it fails
+ * with EAGAIN under ALARM_LIMIT_REJECT; waits until an alarm fires
+ * or is cancelled under ALARM_LIMIT_BLOCK, or fails as under
+ * REJECT if made from the callback or on a virtual clock, where
+ * nothing would fire while it waited; and under ALARM_LIMIT_SHED
+ * drops, of the alarms of the lowest priority set, the one due
+ * last, failing with EAGAIN if that is the new one. No alarm is
+ * dropped for one of lower priority, and dropped alarms never
+ * fire. Changes and cancels are never held up. Alarms already set above
+ * a new, lower limit stay. Returns EINVAL for an unknown policy.
+ */
+#define ALARM_LIMIT_REJECT 0
+#define ALARM_LIMIT_BLOCK  1
+#define ALARM_LIMIT_SHED   2
+
+extern int alarm_sched_limit(alarm_sched_t *sched, unsigned capacity,
+                             int policy);
+
+/*
+ * Run the timer thread, and so every callback, on the CPUs in
+ * "cpus" only (see pthread_setaffinity_np). Memory is placed on
+ * the node of the thread that first touches it, and the alarms
+ * are written by the threads that start and change them, so the
+ * timer thread is best kept on their node. Returns EINVAL on a
+ * virtual clock, which has no timer thread. Declared only where
+ * <sched.h> defines cpu_set_t, which glibc does for _GNU_SOURCE.
+ */
+#ifdef CPU_SETSIZE
+extern int alarm_sched_affinity(alarm_sched_t *sched, size_t setsize,
+                                const cpu_set_t *cpus);
+#endif
+
+/*
+ * Call "visit" for every alarm with an id from "low" to "high", in
+ * id order, and return how many there were. The scan takes no
+ * lock and holds up no other call: alarms started, changed or
+ * cancelled while it runs may or may not be seen, but each alarm
+ * is seen once at most, whole. "info" and its message are valid
+ * only until "visit" returns and must not be released. Up to 64
+ * scans may run at once; more wait for one to finish.
+ */
+typedef void (*alarm_visit_t)(const alarm_info_t *info, void *arg);
+
+extern int alarm_sched_range(alarm_sched_t *sched, int low, int high,
+                             alarm_visit_t visit, void *arg);
+
+/*
+ * Call "visit" for every alarm that will fire from "from" to "to"
+ * (msec from EPOCH, inclusive), in the order they will fire, and
+ * return how many there were. An alarm fires at its deadline or,
+ * with slack, up to its slack after it. "group_id" restricts the
+ * scan to one group, or is ALARM_GROUP_ANY. The cost is O(log n)
+ * plus the alarms in the window, of every group.
+ *
+ * Like alarm_sched_range, the scan takes no lock, but an alarm
+ * changed while it runs -- or a periodic alarm firing -- may be
+ * seen at its old time, its new one, both or neither.
+ */
+extern int alarm_sched_window(alarm_sched_t *sched, long long from,
+                              long long to, int group_id,
+                              alarm_visit_t visit, void *arg);
+
+/*
+ * Drop the message reference held by an alarm_info_t that start,
+ * change or cancel filled in. Safe to call after the call failed:
+ * a failed call leaves "message" NULL.
+ */
+extern void alarm_sched_info_release(alarm_sched_t *sched,
+                                     alarm_info_t *info);
+
+/*
+ * Called by the callback for an ALARM_EVENT_FIRED, keep the
+ * event's message valid past the batch's flush, so that it can be
+ * queued and written out later by another thread without being
+ * copied. Every message kept must be dropped again with
+ * alarm_sched_message_release, which takes a whole queue's worth
+ * under one hold of the lock.
+ */
+extern void alarm_sched_message_keep(alarm_sched_t *sched,
+                                     const alarm_event_t *event);
+extern void alarm_sched_message_release(alarm_sched_t *sched,
+                                        const char **messages, int count);
+
+/*
+ * Stop the timer thread and free the scheduler and every alarm
+ * still pending. No callback is running once it returns.
+ */
+extern void alarm_sched_destroy(alarm_sched_t *sched);
+
+#endif